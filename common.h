@@ -85,6 +85,27 @@ struct data_geometry
     float * data;
 };
 
+// Number of vertices handed to a batched vertex shader in one call.
+static const int VERTEX_BATCH_SIZE = 8;
+
+// Batched versions of data_vertex and data_geometry.  The vertices of a batch
+// are stored as a structure of arrays: data[i][lane] is float i of the vertex
+// in that lane, and gl_Position[i][lane] is coordinate i of its position.
+// Only the first count lanes hold real vertices, but a shader may compute all
+// VERTEX_BATCH_SIZE lanes; the extra results are thrown away.
+struct data_vertex_batch
+{
+    int count;
+    const float (*data)[VERTEX_BATCH_SIZE];
+};
+
+struct data_geometry_batch
+{
+    float gl_Position[DATA_PER_COORD][VERTEX_BATCH_SIZE];
+
+    float (*data)[VERTEX_BATCH_SIZE];
+};
+
 // This is the data that is the input to the fragment shader.  data should be
 // pointed to a new array whose size is MAX_FLOATS_PER_VERTEX.  This data is
 // interpolated from the per-vertex data.
@@ -102,6 +123,37 @@ struct data_fragment
     // int gl_ViewportIndex;
 
     float * data;
+
+    // Screen space derivatives of data: how much each float changes from one
+    // pixel to the next in x (dFdx) and in y (dFdy).  They are only
+    // available when fragments are shaded in 2x2 quads, and are null
+    // otherwise.
+    float * dFdx = 0;
+    float * dFdy = 0;
+};
+
+// Maximum number of pixels in a span handed to a span fragment shader.
+static const int MAX_SPAN = 8;
+
+// Input to a span fragment shader: count consecutive pixels of row y
+// starting at x, of which only those with their bit set in mask are covered.
+// The data is stored as a structure of arrays: data[i][j] is float i of pixel
+// x + j.  A shader may compute all MAX_SPAN pixels; only the covered ones are
+// kept.
+struct data_fragment_span
+{
+    int x, y;
+    int count;
+    unsigned mask;
+
+    const float (*data)[MAX_SPAN];
+};
+
+// Output of a span fragment shader: output_color[i][j] is component i of the
+// color of pixel x + j.
+struct data_output_span
+{
+    float output_color[4][MAX_SPAN];
 };
 
 // This structure stores the color of a pixel (fragment) and is populated by the
@@ -117,8 +169,18 @@ struct data_output
 // Signatures for vertex shaders and fragment shaders.
 typedef void (*shader_v)(const data_vertex&, data_geometry&,const float *);
 
+// Signature for a vertex shader that shades a whole batch of vertices at once.
+// It must produce exactly what the matching shader_v would for each vertex.
+typedef void (*shader_v_batch)(const data_vertex_batch&, data_geometry_batch&,
+    const float *);
+
 typedef void (*shader_f)(const data_fragment&, data_output&,const float *);
 
+// Signature for a fragment shader that shades a whole span of pixels at once.
+// It must produce exactly what the matching shader_f would for each pixel.
+typedef void (*shader_f_span)(const data_fragment_span&, data_output_span&,
+    const float *);
+
 // Different interpolation strategies that may be used to interpolate data from
 // triangle vertices to the pixels (fragments) inside the triangle.
 enum class interp_type {invalid, flat, smooth, noperspective};
@@ -1,4 +1,7 @@
 #include "driver_state.h"
+#include "shaders.h"
+#include "thread_pool.h"
+#include <cmath>
 #include <cstring>
 #include <algorithm>
 #include <climits>
@@ -13,6 +16,7 @@ driver_state::~driver_state()
 {
     delete [] image_color;
     delete [] image_depth;
+    delete pool;
 }
 
 // This function should allocate and initialize the arrays that store color and
@@ -32,6 +36,10 @@ void initialize_render(driver_state& state, int width, int height)
 
     state.image_depth = new float[state.image_len];
     init_image_depth(state);
+    reset_depth_pyramid(state);
+    state.tile_fragments.assign(state.hiz.tiles_x * state.hiz.tiles_y,
+        fragment_counts());
+    state.tile_prepass_fragments = state.tile_fragments;
 }
 
 // This function will be called to render the data that has been stored in this class.
@@ -43,305 +51,1511 @@ void initialize_render(driver_state& state, int width, int height)
 //   render_type::strip -    The vertices are to be interpreted as a triangle strip.
 void render(driver_state& state, render_type type)
 {
-    int triangles;
-    int vert_index = 0;
-    
-    data_geometry * data_geos = new data_geometry[VERT_PER_TRI];
+    int triangles = count_triangles(state, type);
+
+    if (triangles < 0) {
+        std::cerr << "ERROR: Invalid render_type specified." << std::endl;
+        return;
+    }
+
+    build_interp_plan(state);
+
+    // Only the quad loop with the generic pixel path provides derivatives
+    if (state.quad_shading) {
+        state.kernel = rasterize_rect_quads;
+        state.shade_pixel = get_pixel_color;
+    } else {
+        state.kernel =
+            select_raster_kernel(detect_simd_level(state.max_simd));
+        state.shade_pixel = select_pixel_shader(state);
+    }
+
+    // The SIMD loops only know the floating point inside test
+    if (state.subpixel_bits > 0 && !state.quad_shading) {
+        state.kernel = rasterize_rect_scalar;
+    }
+    state.shade_once = state.fragment_shader_constant
+        || (state.fragment_shader_pure && state.plan.num_varying == 0);
+    if (state.fragment_shader_constant) {
+        state.constant_color = calc_constant_color(state);
+    }
+    state.shade_spans = state.fragment_shader_span && !state.shade_once
+        && !state.quad_shading && state.shade_pixel == get_pixel_color;
+    if (state.deferred) {
+        reset_visibility(state);
+    }
+
+    if (state.num_threads > 1 && !state.pool) {
+        state.pool = new thread_pool(state.num_threads);
+    }
+
+    // Run the vertex shader once for every vertex the draw uses, then
+    // assemble the triangles from the shaded vertices.
+    shade_vertices(state, type);
+    if (state.sort_triangles) {
+        sort_triangles_by_depth(state, type, triangles);
+    }
+
+    // The prepass settles the final depth of every pixel without shading,
+    // so the second pass only shades the fragments that end up visible.
+    if (state.depth_prepass) {
+        bool shade_once = state.shade_once;
+        bool shade_spans = state.shade_spans;
+
+        state.depth_only = true;
+        state.shade_once = false;
+        state.shade_spans = false;
+        draw_triangles(state, type, triangles);
+
+        state.depth_only = false;
+        state.shade_once = shade_once;
+        state.shade_spans = shade_spans;
+        state.depth_test = depth_func::equal;
+        draw_triangles(state, type, triangles);
+        state.depth_test = depth_func::less;
+    } else {
+        draw_triangles(state, type, triangles);
+    }
+
+    if (state.deferred) {
+        resolve_visibility(state);
+    }
+}
+
+void draw_triangles(driver_state& state, render_type type, int triangles)
+{
+    int vert_index[VERT_PER_TRI];
+    unsigned outcodes[VERT_PER_TRI];
+    data_geometry data_geos[VERT_PER_TRI];
+    const data_geometry * geos_ptr = data_geos;
+
+    // With more than one thread, clipped triangles are collected into tiles
+    // and rasterized in parallel once the whole draw has been submitted.
+    if (state.num_threads > 1) {
+        reset_tile_bins(state);
+    }
+
+    const vertex_buffer& vb = state.shaded_vertices;
+    for (int i = 0; i < triangles; i++) {
+        int triangle = state.sort_triangles ? state.triangle_order[i] : i;
+        get_triangle_vertices(state, type, triangle, vert_index);
+
+        for (int j = 0; j < VERT_PER_TRI; j++) {
+            const float * vertex = vb.get_vertex(vert_index[j]);
+
+            data_geos[j].gl_Position = vec4(vertex[X], vertex[Y], vertex[Z],
+                vertex[W]);
+            data_geos[j].data = (float *)vertex + DATA_PER_COORD;
+            outcodes[j] = vb.outcodes[vert_index[j]];
+        }
+
+        process_triangle(state, &geos_ptr, outcodes);
+    }
+
+    if (state.num_threads > 1) {
+        flush_tile_bins(state);
+    }
+}
+
+
+void process_triangle(driver_state& state, const data_geometry* in[3],
+    const unsigned * outcodes)
+{
+    // Every vertex is outside of the same face, so the whole triangle is
+    if (outcodes[V_A] & outcodes[V_B] & outcodes[V_C]) {
+        return;
+    }
+
+    if (state.cull_mode != cull_face::none && is_face_culled(state, in)) {
+        return;
+    }
+
+    // No vertex is outside of any face, so there is nothing to clip
+    unsigned crossed = outcodes[V_A] | outcodes[V_B] | outcodes[V_C];
+    if (!crossed) {
+        submit_triangle(state, in);
+        return;
+    }
+
+    // Inside the guard band the rasterizer can handle vertices off the side
+    // of the screen by clamping the bounding box, so only the near and far
+    // faces need real clipping.
+    if (state.guard_band && is_inside_guard_band(in)) {
+        crossed &= NEAR_FAR_FACES;
+        if (!crossed) {
+            submit_triangle(state, in);
+        } else {
+            clip_triangle_faces(state, in, crossed);
+        }
+        return;
+    }
+
+    clip_triangle_faces(state, in, crossed);
+}
+
+void submit_triangle(driver_state& state, const data_geometry* in[3])
+{
+    if (state.num_threads > 1) {
+        bin_triangle(state, in);
+    } else {
+        rasterize_triangle(state, in);
+    }
+}
+
+// This function clips a triangle (defined by the three vertices in the "in" array)
+// against the clipping faces face, face+1, ..., 5 in turn, treating the triangle
+// as a polygon.  The clipped polygon is split into a fan of triangles which are
+// passed on to rasterize_triangle (or binned when rasterizing with multiple
+// threads).
+void clip_triangle(driver_state& state, const data_geometry* in[3],int face)
+{
+    clip_triangle_faces(state, in, ALL_CLIP_FACES & ~((1u << face) - 1));
+}
+
+void clip_triangle_faces(driver_state& state, const data_geometry* in[3],
+    unsigned faces)
+{
+    // The polygon is clipped back and forth between these two buffers
+    clip_vertex buffers[2][MAX_CLIP_VERTICES];
+    clip_vertex * poly = buffers[0];
+    clip_vertex * next = buffers[1];
+    int count = VERT_PER_TRI;
+
+    // Clipped vertices are blends of the original ones, so a face that every
+    // original vertex is inside of cannot cut the polygon.
+    unsigned crossed = 0;
+
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        crossed |= calc_outcode((*in)[i].gl_Position);
+        poly[i].gl_Position = (*in)[i].gl_Position;
+        std::copy((*in)[i].data, (*in)[i].data + state.floats_per_vertex,
+            poly[i].data);
+    }
+
+    crossed &= faces;
+
+    for (int face = 0; face < NUM_CLIP_FACES; face++) {
+        if (!(crossed & (1u << face))) {
+            continue;
+        }
+
+        count = clip_polygon(state, poly, count, next, face);
+
+        // The triangle is completely outside of the plane so we don't need
+        // to do anything.
+        if (count < VERT_PER_TRI) {
+            return;
+        }
+        std::swap(poly, next);
+    }
+
+    // Flat data always comes from the first vertex of the original triangle,
+    // which may have been clipped away.  The rasterizer only reads flat data
+    // from the first vertex of each triangle, which is poly[0] for the whole
+    // fan.
+    for (int i = 0; i < state.floats_per_vertex; i++) {
+        if (state.interp_rules[i] == interp_type::flat) {
+            poly[0].data[i] = (*in)[V_A].data[i];
+        }
+    }
+
+    data_geometry tri[VERT_PER_TRI];
+    const data_geometry * tri_ptr = tri;
+
+    tri[V_A].gl_Position = poly[0].gl_Position;
+    tri[V_A].data = poly[0].data;
+
+    for (int i = 1; i + 1 < count; i++) {
+        tri[V_B].gl_Position = poly[i].gl_Position;
+        tri[V_B].data = poly[i].data;
+        tri[V_C].gl_Position = poly[i + 1].gl_Position;
+        tri[V_C].data = poly[i + 1].data;
+
+        submit_triangle(state, &tri_ptr);
+    }
+}
+
+// Rasterize the triangle defined by the three vertices in the "in" array.  This
+// function is responsible for rasterization, interpolation of data to
+// fragments, calling the fragment shader, and z-buffering.
+void rasterize_triangle(driver_state& state, const data_geometry* in[3])
+{
+    triangle_setup setup;
+
+    if (!setup_triangle(state, in, setup)) {
+        return;
+    }
+    if (state.deferred) {
+        add_visible_triangle(state, in, setup);
+    }
+    count_raster_path(state, setup);
+
+    rasterize_triangle_rect(state, in, setup, 0, 0, state.image_width - 1,
+        state.image_height - 1);
+}
+
+raster_path classify_raster_path(const driver_state& state, int width,
+    int height)
+{
+    const raster_thresholds& limits = state.thresholds;
+    int shorter = std::min(width, height);
+    int longer = std::max(width, height);
+
+    // Quads need their helper pixels, so they never take the small path
+    if (longer <= limits.small_extent && !state.quad_shading) {
+        return raster_path::small;
+    }
+
+    // Long thin boxes are mostly blocks cut by an edge, which gain nothing
+    // from the block tests
+    if (shorter >= limits.block_extent
+        && longer <= (long long)shorter * limits.max_block_aspect) {
+        return raster_path::blocks;
+    }
+
+    return raster_path::scanline;
+}
+
+void count_raster_path(driver_state& state, const triangle_setup& setup)
+{
+    if (state.depth_only) {
+        return;
+    }
+
+    raster_path path = classify_raster_path(state,
+        setup.max_x - setup.min_x + 1, setup.max_y - setup.min_y + 1);
+
+    state.raster_path_count[(int)path]++;
+}
+
+void rasterize_triangle_rect(driver_state& state, const data_geometry* in[3],
+    const triangle_setup& setup, int x0, int y0, int x1, int y1)
+{
+    raster_kernel kernel = state.kernel ? state.kernel : rasterize_rect_scalar;
+    attribute_planes planes;
+
+    int width = std::min(setup.max_x, x1) - std::max(setup.min_x, x0) + 1;
+    int height = std::min(setup.max_y, y1) - std::max(setup.min_y, y0) + 1;
+    raster_path path = classify_raster_path(state, width, height);
+
+    // Skip triangles that are behind everything already drawn where they
+    // land.  Big triangles are instead tested block by block below.
+    if (path != raster_path::blocks
+        && is_rect_hidden(state, setup, x0, y0, x1, y1)) {
+        count_hidden(state, std::max(setup.min_x, x0),
+            std::max(setup.min_y, y0), 1, 0);
+        return;
+    }
+
+    if (path == raster_path::small) {
+        rasterize_small_triangle(state, in, setup, x0, y0, x1, y1);
+        return;
+    }
+
+    // Big triangles are walked block by block so that empty parts of the
+    // bounding box are skipped wholesale.
+    if (path == raster_path::blocks) {
+        kernel = rasterize_rect_blocks;
+    }
+
+    // Depth-only passes need nothing but the setup.  Deferred triangles only
+    // record their id; their planes are built when the visibility buffer is
+    // resolved.
+    if (state.depth_only) {
+        kernel(state, setup, planes, x0, y0, x1, y1);
+        return;
+    }
+    if (state.deferred) {
+        planes.id = setup.id;
+        kernel(state, setup, planes, x0, y0, x1, y1);
+        return;
+    }
+
+    setup_triangle_shading(state, in, setup, state.shade_once, planes);
+    kernel(state, setup, planes, x0, y0, x1, y1);
+}
+
+void rasterize_small_triangle(driver_state& state, const data_geometry* in[3],
+    const triangle_setup& setup, int x0, int y0, int x1, int y1)
+{
+    static const int SMALL_PIXELS =
+        SMALL_TRIANGLE_EXTENT * SMALL_TRIANGLE_EXTENT;
+
+    float depth[SMALL_PIXELS];
+    unsigned row_mask[SMALL_TRIANGLE_EXTENT];
+    unsigned mask = 0;
+    int tested = 0;
+    int passed = 0;
+    attribute_planes planes;
+
+    int min_x = std::max(setup.min_x, x0);
+    int min_y = std::max(setup.min_y, y0);
+    int width = std::min(setup.max_x, x1) - min_x + 1;
+    int height = std::min(setup.max_y, y1) - min_y + 1;
+
+    // Test every candidate pixel first.  The weights are evaluated the same
+    // way as in the run based loops, so the same pixels are drawn.
+    for (int j = 0; j < height; j++) {
+        int y = min_y + j;
+        row_mask[j] = 0;
+
+        for (int i = 0; i < width; i++) {
+            int x = min_x + i;
+            int run = x - x % RASTER_STEP;
+            float bary[VERT_PER_TRI];
+
+            for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                bary[vert] = calc_run_start(setup, vert, run, y)
+                    + setup.x_step[vert][x - run];
+            }
+            if (!is_sample_covered(setup, x, y, bary)) {
+                continue;
+            }
+
+            float d = calc_depth_at(setup.z, bary);
+            tested++;
+            if (passes_depth_test(state.depth_test, d,
+                state.image_depth[x + y * state.image_width])) {
+                depth[i + j * SMALL_TRIANGLE_EXTENT] = d;
+                row_mask[j] |= 1u << i;
+                passed++;
+            }
+        }
+        mask |= row_mask[j];
+    }
+
+    if (tested) {
+        count_fragments(state, min_x, min_y, tested, passed);
+    }
+    if (!mask) {
+        return;
+    }
+
+    // Deferred triangles only record their id, and depth-only passes shade
+    // nothing
+    if (state.deferred) {
+        planes.id = setup.id;
+    } else if (!state.depth_only) {
+        setup_triangle_shading(state, in, setup, state.shade_once, planes);
+    }
+
+    fragment_scratch scratch;
+    init_fragment_scratch(state, planes, scratch);
+
+    for (int j = 0; j < height; j++) {
+        int y = min_y + j;
+        unsigned pixel_index = min_x + y * state.image_width;
+
+        if (!row_mask[j]) {
+            continue;
+        }
+
+        for (int i = 0; i < width; i++) {
+            if (!(row_mask[j] & (1u << i))) {
+                continue;
+            }
+
+            if (state.deferred) {
+                record_visibility(state, planes, pixel_index + i);
+            } else if (!state.shade_spans && !state.depth_only) {
+                state.image_color[pixel_index + i] =
+                    shade_fragment(state, scratch.frag, planes, min_x + i, y);
+            }
+            state.image_depth[pixel_index + i] =
+                depth[i + j * SMALL_TRIANGLE_EXTENT];
+        }
+        mark_depth_written(state, min_x, y);
+        mark_depth_written(state, min_x + width - 1, y);
+
+        // Spans need not start on a run, so each row is shaded as one span
+        if (state.shade_spans) {
+            shade_span(state, planes, min_x, y, width, row_mask[j]);
+        }
+    }
+}
+
+// Shared body of the scalar loops.  When test_inside is false every pixel of
+// the rectangle is assumed to be inside the triangle.
+template<bool test_inside>
+static void rasterize_rect_loop(driver_state& state,
+    const triangle_setup& setup, const attribute_planes& planes, int x0,
+    int y0, int x1, int y1)
+{
+    unsigned pixel_index;
+    float depth;
+    float bary[RASTER_STEP][VERT_PER_TRI];
+    int tested = 0;
+    int passed = 0;
+
+    fragment_scratch scratch;
+    init_fragment_scratch(state, planes, scratch);
+
+    // Only visit the pixels of the bounding box that are inside the rectangle
+    int min_x = std::max(setup.min_x, x0);
+    int min_y = std::max(setup.min_y, y0);
+    int max_x = std::min(setup.max_x, x1);
+    int max_y = std::min(setup.max_y, y1);
+
+    // Walk each row in runs that start on a multiple of RASTER_STEP.  The
+    // weights of a whole run are stepped from a single evaluation of the edge
+    // functions.
+    for (int y = min_y; y <= max_y; y++) {
+        for (int run = min_x - min_x % RASTER_STEP; run <= max_x;
+            run += RASTER_STEP) {
+
+            int first = std::max(min_x - run, 0);
+            int count = std::min(max_x - run + 1, RASTER_STEP);
+
+            unsigned mask = 0;
+
+            calc_bary_run(setup, run, y, count, bary);
+
+            for (int i = first; i < count; i++) {
+                // Only draw if the pixel is inside the triangle and it is the
+                // closest triangle to the camera
+                if (test_inside && !is_sample_covered(setup, run + i, y,
+                    bary[i])) {
+                    continue;
+                }
+
+                depth = calc_depth_at(setup.z, bary[i]);
+                pixel_index = run + i + y * state.image_width;
+                tested++;
+
+                if (passes_depth_test(state.depth_test, depth,
+                    state.image_depth[pixel_index])) {
+                    // Span shaded pixels get their color once the whole run
+                    // is known
+                    if (state.deferred) {
+                        record_visibility(state, planes, pixel_index);
+                    } else if (!state.shade_spans && !state.depth_only) {
+                        state.image_color[pixel_index] =
+                            shade_fragment(state, scratch.frag, planes,
+                                run + i, y);
+                    }
+                    state.image_depth[pixel_index] = depth;
+                    mask |= 1u << i;
+                    passed++;
+                }
+            }
+
+            if (mask) {
+                if (state.shade_spans) {
+                    shade_span(state, planes, run, y, count, mask);
+                }
+                mark_depth_written(state, run, y);
+            }
+        }
+    }
+
+    if (tested) {
+        count_fragments(state, min_x, min_y, tested, passed);
+    }
+}
+
+void rasterize_rect_scalar(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    rasterize_rect_loop<true>(state, setup, planes, x0, y0, x1, y1);
+}
+
+void rasterize_rect_covered(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    rasterize_rect_loop<false>(state, setup, planes, x0, y0, x1, y1);
+}
+
+void rasterize_rect_quads(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    static const int QUAD_PIXELS = 4;
+
+    float depth[QUAD_PIXELS];
+    float quad_data[QUAD_PIXELS][MAX_FLOATS_PER_VERTEX];
+    float dFdx[MAX_FLOATS_PER_VERTEX];
+    float dFdy[MAX_FLOATS_PER_VERTEX];
+    float frag_data[MAX_FLOATS_PER_VERTEX];
+    data_fragment frag;
+    frag.data = frag_data;
+
+    // Passes that only record depth or visibility shade nothing, and
+    // triangles shaded once already have their color.  Neither needs the
+    // quad's data.
+    bool shade_quads = !state.shade_once && !state.depth_only
+        && !state.deferred && state.shade_pixel == get_pixel_color;
+    int tested = 0;
+    int passed = 0;
+
+    int min_x = std::max(setup.min_x, x0);
+    int min_y = std::max(setup.min_y, y0);
+    int max_x = std::min(setup.max_x, x1);
+    int max_y = std::min(setup.max_y, y1);
+
+    for (int qy = min_y - min_y % 2; qy <= max_y; qy += 2) {
+        for (int qx = min_x - min_x % 2; qx <= max_x; qx += 2) {
+            unsigned mask = 0;
+
+            // Find the pixels of the quad to draw.  The weights are
+            // evaluated the same way as in the run based loops.
+            for (int p = 0; p < QUAD_PIXELS; p++) {
+                int x = qx + p % 2;
+                int y = qy + p / 2;
+                int run = x - x % RASTER_STEP;
+                float bary[VERT_PER_TRI];
+
+                if (x < min_x || x > max_x || y < min_y || y > max_y) {
+                    continue;
+                }
+
+                for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                    bary[vert] = calc_run_start(setup, vert, run, y)
+                        + setup.x_step[vert][x - run];
+                }
+                if (!is_sample_covered(setup, x, y, bary)) {
+                    continue;
+                }
+
+                depth[p] = calc_depth_at(setup.z, bary);
+                tested++;
+                if (passes_depth_test(state.depth_test, depth[p],
+                    state.image_depth[x + y * state.image_width])) {
+                    mask |= 1u << p;
+                    passed++;
+                }
+            }
+
+            if (!mask) {
+                continue;
+            }
+
+            if (shade_quads) {
+                interpolate_quad(state, planes, qx, qy, quad_data, dFdx,
+                    dFdy);
+                frag.dFdx = dFdx;
+                frag.dFdy = dFdy;
+            }
+
+            for (int p = 0; p < QUAD_PIXELS; p++) {
+                if (!(mask & (1u << p))) {
+                    continue;
+                }
+
+                int x = qx + p % 2;
+                int y = qy + p / 2;
+                unsigned pixel_index = x + y * state.image_width;
+
+                if (shade_quads) {
+                    frag.data = quad_data[p];
+                    state.image_color[pixel_index] =
+                        run_fragment_shader(state, frag);
+                } else if (state.deferred) {
+                    record_visibility(state, planes, pixel_index);
+                } else if (!state.depth_only) {
+                    state.image_color[pixel_index] =
+                        shade_fragment(state, frag, planes, x, y);
+                }
+                state.image_depth[pixel_index] = depth[p];
+                mark_depth_written(state, x, y);
+            }
+        }
+    }
+
+    if (tested) {
+        count_fragments(state, min_x, min_y, tested, passed);
+    }
+}
+
+void rasterize_rect_blocks(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    raster_kernel kernel = state.kernel ? state.kernel : rasterize_rect_scalar;
+    raster_kernel covered_kernel =
+        state.quad_shading ? kernel : rasterize_rect_covered;
+    double margin[VERT_PER_TRI];
+    int hidden = 0;
+
+    int min_x = std::max(setup.min_x, x0);
+    int min_y = std::max(setup.min_y, y0);
+    int max_x = std::min(setup.max_x, x1);
+    int max_y = std::min(setup.max_y, y1);
+
+    // The weights the pixel loops compute are rounded, so a block is only
+    // classified when its corners are further from the edge than the
+    // rounding error could reach.  This keeps the result identical to
+    // testing every pixel.
+    for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+        margin[vert] = 4 * FLT_EPSILON * (std::fabs(setup.k0[vert])
+            + std::fabs(setup.k1[vert]) * (max_x + RASTER_STEP)
+            + std::fabs(setup.k2[vert]) * (max_y + 1));
+    }
+
+    for (int by = min_y - min_y % BLOCK_SIZE; by <= max_y;
+        by += BLOCK_SIZE) {
+        for (int bx = min_x - min_x % BLOCK_SIZE; bx <= max_x;
+            bx += BLOCK_SIZE) {
+
+            // Blocks that are hidden need no weights at all
+            if (is_depth_hidden(state, setup.nearest_depth,
+                get_block_farthest(state, bx / BLOCK_SIZE, by / BLOCK_SIZE))) {
+                hidden++;
+                continue;
+            }
+
+            bool outside = false;
+            bool covered = true;
+
+            for (int vert = 0; vert < VERT_PER_TRI && !outside; vert++) {
+                // The edge functions are linear, so their extremes over the
+                // block are at its corners.
+                double e00 = calc_edge_at(setup, vert, bx, by);
+                double e10 = calc_edge_at(setup, vert, bx + BLOCK_SIZE - 1,
+                    by);
+                double e01 = calc_edge_at(setup, vert, bx,
+                    by + BLOCK_SIZE - 1);
+                double e11 = calc_edge_at(setup, vert, bx + BLOCK_SIZE - 1,
+                    by + BLOCK_SIZE - 1);
+                double lo = std::min(std::min(e00, e10), std::min(e01, e11));
+                double hi = std::max(std::max(e00, e10), std::max(e01, e11));
+
+                outside = hi < -margin[vert];
+                covered = covered && lo > margin[vert];
+            }
+
+            if (outside) {
+                continue;
+            }
+
+            int rx0 = std::max(bx, min_x);
+            int ry0 = std::max(by, min_y);
+            int rx1 = std::min(bx + BLOCK_SIZE - 1, max_x);
+            int ry1 = std::min(by + BLOCK_SIZE - 1, max_y);
+
+            if (covered) {
+                covered_kernel(state, setup, planes, rx0, ry0, rx1, ry1);
+            } else {
+                kernel(state, setup, planes, rx0, ry0, rx1, ry1);
+            }
+        }
+    }
+
+    if (hidden) {
+        count_hidden(state, min_x, min_y, 0, hidden);
+    }
+}
 
+
+/**************************************************************************/
+/* Initialization */
+/**************************************************************************/
+
+void set_render_black(driver_state& state) {
+    for (int i = 0; i < state.image_len; i++) {
+        state.image_color[i] = make_pixel(0, 0, 0);
+    }
+}
+
+void init_image_depth(driver_state& state) {
+    for (int i = 0; i < state.image_len; i++) {
+        state.image_depth[i] = FLT_MAX;
+    }
+}
+
+
+/**************************************************************************/
+/* Render Helpers */
+/**************************************************************************/
+
+int count_triangles(const driver_state& state, render_type type) {
     switch (type) {
     case render_type::triangle:
-        triangles = state.num_vertices / VERT_PER_TRI;
-        
-        for (int i = 0; i < triangles; i++) {
-            fill_data_geo_triangle(state, &data_geos, vert_index);
-            calc_data_geo_pos(state, &data_geos);
-            clip_triangle(state, (const data_geometry **)(&data_geos), 0);
+        return state.num_vertices / VERT_PER_TRI;
+
+    case render_type::indexed:
+        return state.num_triangles;
+
+    case render_type::fan:
+    case render_type::strip:
+        return std::max(state.num_vertices - 2, 0);
+
+    default:
+        return -1;
+    }
+}
+
+void get_triangle_vertices(const driver_state& state, render_type type,
+    int triangle, int * vert_index) {
+
+    switch (type) {
+    case render_type::triangle:
+        for (int i = 0; i < VERT_PER_TRI; i++) {
+            vert_index[i] = triangle * VERT_PER_TRI + i;
         }
         break;
 
     case render_type::indexed:
-        for (int i = 0; i < state.num_triangles; i++) {
-            fill_data_geos_indexed(state, &data_geos, vert_index); 
-            calc_data_geo_pos(state, &data_geos);
-            clip_triangle(state, (const data_geometry **)(&data_geos), 0);
+        for (int i = 0; i < VERT_PER_TRI; i++) {
+            vert_index[i] = state.index_data[triangle * VERT_PER_TRI + i];
         }
         break;
 
+    // Every triangle of a fan shares the first vertex
     case render_type::fan:
-        triangles = state.num_vertices - 2;
-        vert_index = 1;
-        data_geos[0].data = state.vertex_data;
-        for (int i = 0; i < triangles; i++) {
-            fill_data_geos_fan(state, &data_geos, vert_index);
-            calc_data_geo_pos(state, &data_geos);
-            clip_triangle(state, (const data_geometry **)(&data_geos), 0);
-        }       
+        vert_index[V_A] = 0;
+        vert_index[V_B] = triangle + 1;
+        vert_index[V_C] = triangle + 2;
         break;
 
+    // Every other triangle of a strip swaps its last two vertices so that all
+    // of them keep the same winding
     case render_type::strip:
-        triangles = state.num_vertices - 2;
-        // Prime the fill_data_geo_strip function
-        fill_data_geo_triangle(state, &data_geos, vert_index);
-        calc_data_geo_pos(state, &data_geos);
-        clip_triangle(state, (const data_geometry **)(&data_geos), 0);
-        for (int i = 1; i < triangles; i++) {
-            fill_data_geos_strip(state, &data_geos, vert_index, i);
-            calc_data_geo_pos(state, &data_geos);
-            clip_triangle(state, (const data_geometry **)(&data_geos), 0);
-        }
+        vert_index[V_A] = triangle;
+        vert_index[V_B] = triangle + 1 + triangle % 2;
+        vert_index[V_C] = triangle + 2 - triangle % 2;
         break;
 
     default:
-        std::cerr << "ERROR: Invalid render_type specified." << std::endl;
+        break;
+    }
+}
+
+void sort_triangles_by_depth(driver_state& state, render_type type,
+    int triangles) {
+
+    static const int KEY_BITS = 16;
+    static const int RADIX_BITS = 8;
+    static const int RADIX_SIZE = 1 << RADIX_BITS;
+    static const unsigned MAX_KEY = (1u << KEY_BITS) - 1;
+
+    const vertex_buffer& vb = state.shaded_vertices;
+    std::vector<unsigned> keys(triangles);
+    std::vector<int> sorted(triangles);
+    std::vector<int>& order = state.triangle_order;
+    int vert_index[VERT_PER_TRI];
+
+    // The key is the nearest depth of the vertices, mapped from [-1, 1] to
+    // [0, MAX_KEY].  Vertices behind the eye have no meaningful depth, so
+    // their triangles go first.
+    for (int i = 0; i < triangles; i++) {
+        float nearest = 1;
+
+        get_triangle_vertices(state, type, i, vert_index);
+        for (int j = 0; j < VERT_PER_TRI; j++) {
+            const float * vertex = vb.get_vertex(vert_index[j]);
+            float depth = vertex[W] > 0 ? vertex[Z] / vertex[W] : -1;
+
+            nearest = std::min(nearest, depth);
+        }
+
+        nearest = std::max(nearest, -1.0f);
+        keys[i] = (unsigned)((nearest + 1) * .5f * MAX_KEY);
+    }
+
+    order.resize(triangles);
+    for (int i = 0; i < triangles; i++) {
+        order[i] = i;
     }
 
-    delete[] data_geos;
+    // Least significant digit first; each counting pass is stable
+    for (int shift = 0; shift < KEY_BITS; shift += RADIX_BITS) {
+        int start[RADIX_SIZE] = {};
+
+        for (int i = 0; i < triangles; i++) {
+            start[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+        }
+        for (int d = 0, total = 0; d < RADIX_SIZE; d++) {
+            int count = start[d];
+            start[d] = total;
+            total += count;
+        }
+        for (int i = 0; i < triangles; i++) {
+            int t = order[i];
+            sorted[start[(keys[t] >> shift) & (RADIX_SIZE - 1)]++] = t;
+        }
+        order.swap(sorted);
+    }
 }
 
+void shade_vertices(driver_state& state, render_type type) {
+    vertex_buffer& vb = state.shaded_vertices;
+
+    // Round the stride up to a whole number of 16 byte vectors so every
+    // vertex starts aligned
+    vb.stride = (DATA_PER_COORD + state.floats_per_vertex + 3) & ~3;
+    vb.data.resize(vb.stride * state.num_vertices);
+    vb.outcodes.resize(state.num_vertices);
+
+    // Indexed draws may skip some of the vertices, so only shade those that
+    // are referenced.  Every other layout uses every vertex up to the last
+    // triangle.
+    std::vector<unsigned char> used;
+    int num_used = state.num_vertices;
+    if (type == render_type::indexed) {
+        used.assign(state.num_vertices, 0);
+        for (int i = 0; i < state.num_triangles * VERT_PER_TRI; i++) {
+            used[state.index_data[i]] = 1;
+        }
+    } else if (type == render_type::triangle) {
+        num_used = count_triangles(state, type) * VERT_PER_TRI;
+    }
 
-// This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
-void clip_triangle(driver_state& state, const data_geometry* in[3],int face)
-{
-    std::vector<data_geometry *> tris;
-    int sign = 2 * (face % 2) - 1;
-    unsigned axis = face % 3;
-    bool inside[VERT_PER_TRI] = {0};
+    // Vertices are independent, so with more than one thread they are
+    // shaded in chunks spread over the worker pool.  Chunks hold whole
+    // batches so batches never straddle two jobs.
+    int batch = state.vertex_shader_batch ? VERTEX_BATCH_SIZE : 1;
+    int chunk = std::max(state.vertex_chunk_size, 1);
+    chunk = (chunk + batch - 1) / batch * batch;
+    int num_chunks = (num_used + chunk - 1) / chunk;
+    auto shade_chunk = [&](int job, int worker) {
+        int end = std::min((job + 1) * chunk, num_used);
+        for (int i = job * chunk; i < end; i += batch) {
+            int count = std::min(batch, end - i);
+
+            // Skip batches with no referenced vertices.  Unreferenced
+            // vertices in a partly used batch are shaded along with the
+            // rest, which is harmless.
+            if (used.size() &&
+                std::find(&used[i], &used[i] + count, 1) == &used[i] + count) {
+                continue;
+            }
 
-    if(face==6)
-    {
-        rasterize_triangle(state, in);
+            if (state.vertex_shader_batch) {
+                shade_vertex_batch(state, i, count);
+            } else {
+                shade_vertex(state, i);
+            }
+        }
+    };
+
+    if (state.num_threads > 1) {
+        state.pool->run(num_chunks, shade_chunk);
+    } else {
+        for (int i = 0; i < num_chunks; i++) {
+            shade_chunk(i, 0);
+        }
+    }
+}
+
+void shade_vertex_batch(driver_state& state, int first, int count) {
+    vertex_buffer& vb = state.shaded_vertices;
+    int num_floats = state.floats_per_vertex;
+
+    float in_data[MAX_FLOATS_PER_VERTEX][VERTEX_BATCH_SIZE];
+    float out_data[MAX_FLOATS_PER_VERTEX][VERTEX_BATCH_SIZE];
+    data_vertex_batch in;
+    data_geometry_batch out;
+
+    in.count = count;
+    in.data = in_data;
+    out.data = out_data;
+
+    // Transpose the vertices into the batch.  Unused lanes are zeroed so the
+    // shader never computes on garbage.
+    for (int lane = 0; lane < VERTEX_BATCH_SIZE; lane++) {
+        for (int i = 0; i < num_floats; i++) {
+            in_data[i][lane] = lane < count ?
+                state.vertex_data[(first + lane) * num_floats + i] : 0;
+        }
+    }
+
+    // As with shade_vertex, data the shader does not write is passed through
+    std::copy(&in_data[0][0], &in_data[0][0] + num_floats * VERTEX_BATCH_SIZE,
+        &out_data[0][0]);
+    state.vertex_shader_batch(in, out, state.uniform_data);
+
+    for (int lane = 0; lane < count; lane++) {
+        float * vertex = &vb.data[(first + lane) * vb.stride];
+        vec4 position;
+
+        for (int i = 0; i < DATA_PER_COORD; i++) {
+            position[i] = out.gl_Position[i][lane];
+            vertex[i] = position[i];
+        }
+        for (int i = 0; i < num_floats; i++) {
+            vertex[DATA_PER_COORD + i] = out_data[i][lane];
+        }
+        vb.outcodes[first + lane] = calc_outcode(position);
+    }
+}
+
+void shade_vertex(driver_state& state, int index) {
+    vertex_buffer& vb = state.shaded_vertices;
+    float * vertex = &vb.data[index * vb.stride];
+    data_vertex in;
+    data_geometry out;
+
+    in.data = state.vertex_data + index * state.floats_per_vertex;
+    out.data = vertex + DATA_PER_COORD;
+
+    // Shaders only write the data they change, the rest of the vertex is
+    // passed through
+    std::copy(in.data, in.data + state.floats_per_vertex, out.data);
+    state.vertex_shader(in, out, state.uniform_data);
+
+    for (int i = 0; i < DATA_PER_COORD; i++) {
+        vertex[i] = out.gl_Position[i];
+    }
+    vb.outcodes[index] = calc_outcode(out.gl_Position);
+}
+
+
+/**************************************************************************/
+/* Tile Binning */
+/**************************************************************************/
+
+void reset_tile_bins(driver_state& state) {
+    tile_bins& bins = state.bins;
+
+    bins.tiles_x = (state.image_width + TILE_SIZE - 1) / TILE_SIZE;
+    bins.tiles_y = (state.image_height + TILE_SIZE - 1) / TILE_SIZE;
+    bins.vertex_data.clear();
+    bins.setups.clear();
+    bins.num_triangles = 0;
+
+    // Keep the per-tile vectors around so their storage is reused between
+    // renders
+    bins.tiles.resize(bins.tiles_x * bins.tiles_y);
+    for (unsigned i = 0; i < bins.tiles.size(); i++) {
+        bins.tiles[i].clear();
+    }
+}
+
+void bin_triangle(driver_state& state, const data_geometry* in[3]) {
+    tile_bins& bins = state.bins;
+    triangle_setup setup;
+
+    if (!setup_triangle(state, in, setup)) {
         return;
-    } 
-    
-    add_data_geos(state, tris, in);
+    }
+    if (state.deferred) {
+        add_visible_triangle(state, in, setup);
+    }
+    count_raster_path(state, setup);
+    bins.setups.push_back(setup);
 
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        // sign will always be either -1 or +1 depending on face
-        if (sign > 0) {
-            inside[i] = (*in)[i].gl_Position[axis] <=
-                (*in)[i].gl_Position[W];
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        for (int j = 0; j < DATA_PER_COORD; j++) {
+            bins.vertex_data.push_back((*in)[i].gl_Position[j]);
         }
-        if (sign < 0) {
-            inside[i] = (*in)[i].gl_Position[axis] >=
-                -1 * (*in)[i].gl_Position[W];
+        bins.vertex_data.insert(bins.vertex_data.end(), (*in)[i].data,
+            (*in)[i].data + state.floats_per_vertex);
+    }
+
+    for (int ty = setup.min_y / TILE_SIZE; ty <= setup.max_y / TILE_SIZE;
+        ty++) {
+        for (int tx = setup.min_x / TILE_SIZE; tx <= setup.max_x / TILE_SIZE;
+            tx++) {
+            bins.tiles[tx + ty * bins.tiles_x].push_back(bins.num_triangles);
+        }
+    }
+    bins.num_triangles++;
+}
+
+void flush_tile_bins(driver_state& state) {
+    tile_bins& bins = state.bins;
+    int vertex_size = DATA_PER_COORD + state.floats_per_vertex;
+
+    // Rebuild the geometry now that vertex_data has stopped growing and its
+    // storage will not move
+    std::vector<data_geometry> geos(bins.num_triangles * VERT_PER_TRI);
+    for (unsigned i = 0; i < geos.size(); i++) {
+        const float * vertex = &bins.vertex_data[i * vertex_size];
+        geos[i].gl_Position = vec4(vertex[X], vertex[Y], vertex[Z],
+            vertex[W]);
+        geos[i].data = (float *)vertex + DATA_PER_COORD;
+    }
+
+    // Tiles do not share pixels, so each one can be rasterized independently
+    // as long as its own triangles are drawn in order.
+    state.pool->run(bins.tiles.size(), [&](int tile, int worker) {
+        int x0 = (tile % bins.tiles_x) * TILE_SIZE;
+        int y0 = (tile / bins.tiles_x) * TILE_SIZE;
+        int x1 = std::min(x0 + TILE_SIZE, state.image_width) - 1;
+        int y1 = std::min(y0 + TILE_SIZE, state.image_height) - 1;
+        const std::vector<int>& tris = bins.tiles[tile];
+
+        for (unsigned i = 0; i < tris.size(); i++) {
+            const triangle_setup& setup = bins.setups[tris[i]];
+            const data_geometry * tri = &geos[tris[i] * VERT_PER_TRI];
+
+            if (is_depth_hidden(state, setup.nearest_depth,
+                get_tile_farthest(state, tile % bins.tiles_x,
+                tile / bins.tiles_x))) {
+                count_hidden(state, x0, y0, 1, 0);
+                continue;
+            }
+
+            rasterize_triangle_rect(state, &tri, setup, x0, y0, x1, y1);
+        }
+    });
+
+    reset_tile_bins(state);
+}
+
+
+/**************************************************************************/
+/* Visibility Buffer */
+/**************************************************************************/
+
+void reset_visibility(driver_state& state) {
+    visibility_buffer& vis = state.vis;
+
+    vis.ids.assign(state.image_len, -1);
+    vis.setups.clear();
+    vis.vertex_data.clear();
+    vis.planes.clear();
+    vis.shade_once = state.shade_once;
+    state.shade_once = false;
+
+    // Recording needs the id of every pixel, and the resolve pass shades
+    // pixel by pixel
+    state.shade_spans = false;
+}
+
+void add_visible_triangle(driver_state& state, const data_geometry* in[3],
+    triangle_setup& setup) {
+
+    visibility_buffer& vis = state.vis;
+
+    setup.id = vis.setups.size();
+    vis.setups.push_back(setup);
+
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        for (int j = 0; j < DATA_PER_COORD; j++) {
+            vis.vertex_data.push_back((*in)[i].gl_Position[j]);
+        }
+        vis.vertex_data.insert(vis.vertex_data.end(), (*in)[i].data,
+            (*in)[i].data + state.floats_per_vertex);
+    }
+}
+
+void build_visible_planes(driver_state& state) {
+    visibility_buffer& vis = state.vis;
+    int vertex_size = DATA_PER_COORD + state.floats_per_vertex;
+    std::vector<int> plane_index(vis.setups.size(), -1);
+    std::vector<int> visible;
+
+    // Number the triangles left visible in the order they are first seen
+    for (int i = 0; i < state.image_len; i++) {
+        int id = vis.ids[i];
+
+        if (id < 0) {
+            continue;
+        }
+        if (plane_index[id] < 0) {
+            plane_index[id] = visible.size();
+            visible.push_back(id);
+        }
+        vis.ids[i] = plane_index[id];
+    }
+
+    vis.planes.resize(visible.size());
+
+    auto build_planes = [&](int index, int worker) {
+        int id = visible[index];
+        data_geometry geos[VERT_PER_TRI];
+        const data_geometry * in = geos;
+
+        for (int i = 0; i < VERT_PER_TRI; i++) {
+            const float * vertex =
+                &vis.vertex_data[(id * VERT_PER_TRI + i) * vertex_size];
+            geos[i].gl_Position = vec4(vertex[X], vertex[Y], vertex[Z],
+                vertex[W]);
+            geos[i].data = (float *)vertex + DATA_PER_COORD;
+        }
+
+        setup_triangle_shading(state, &in, vis.setups[id], state.shade_once,
+            vis.planes[index]);
+    };
+
+    if (state.num_threads > 1) {
+        state.pool->run(visible.size(), build_planes);
+    } else {
+        for (unsigned i = 0; i < visible.size(); i++) {
+            build_planes(i, 0);
+        }
+    }
+}
+
+void resolve_visibility(driver_state& state) {
+    visibility_buffer& vis = state.vis;
+
+    state.shade_once = vis.shade_once;
+    build_visible_planes(state);
+
+    // Each pixel is shaded independently, so rows can be done in any order
+    auto resolve_row = [&](int y, int worker) {
+        float frag_data[MAX_FLOATS_PER_VERTEX];
+        data_fragment frag;
+        frag.data = frag_data;
+        int last_id = -1;
+
+        for (int x = 0; x < state.image_width; x++) {
+            unsigned pixel_index = x + y * state.image_width;
+            int id = vis.ids[pixel_index];
+
+            if (id < 0) {
+                continue;
+            }
+
+            // Neighbouring pixels mostly see the same triangle, so its flat
+            // data is only stored again when the triangle changes
+            if (id != last_id && !state.shade_once) {
+                set_flat_data(state, vis.planes[id], frag_data);
+                last_id = id;
+            }
+
+            state.image_color[pixel_index] =
+                shade_fragment(state, frag, vis.planes[id], x, y);
         }
+    };
+
+    if (state.num_threads > 1) {
+        state.pool->run(state.image_height, resolve_row);
+    } else {
+        for (int y = 0; y < state.image_height; y++) {
+            resolve_row(y, 0);
+        }
+    }
+}
+
+
+/**************************************************************************/
+/* Hierarchical Z */
+/**************************************************************************/
+
+void reset_depth_pyramid(driver_state& state) {
+    depth_pyramid& hiz = state.hiz;
+
+    hiz.blocks_x = (state.image_width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    hiz.blocks_y = (state.image_height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    hiz.block_farthest.assign(hiz.blocks_x * hiz.blocks_y, FLT_MAX);
+    hiz.block_dirty.assign(hiz.blocks_x * hiz.blocks_y, 1);
+
+    hiz.tiles_x = (state.image_width + TILE_SIZE - 1) / TILE_SIZE;
+    hiz.tiles_y = (state.image_height + TILE_SIZE - 1) / TILE_SIZE;
+    hiz.tile_farthest.assign(hiz.tiles_x * hiz.tiles_y, FLT_MAX);
+    hiz.tile_dirty.assign(hiz.tiles_x * hiz.tiles_y, 1);
+}
+
+void mark_depth_written(driver_state& state, int x, int y) {
+    depth_pyramid& hiz = state.hiz;
+
+    hiz.block_dirty[x / BLOCK_SIZE + (y / BLOCK_SIZE) * hiz.blocks_x] = 1;
+    hiz.tile_dirty[x / TILE_SIZE + (y / TILE_SIZE) * hiz.tiles_x] = 1;
+}
+
+// Counts of the pass being drawn for the tile holding pixel (x, y)
+static fragment_counts& get_tile_counts(driver_state& state, int x, int y) {
+    std::vector<fragment_counts>& tiles = state.depth_only
+        ? state.tile_prepass_fragments : state.tile_fragments;
+
+    return tiles[x / TILE_SIZE + (y / TILE_SIZE) * state.hiz.tiles_x];
+}
+
+void count_fragments(driver_state& state, int x, int y, int tested,
+    int passed) {
+
+    fragment_counts& counts = get_tile_counts(state, x, y);
+
+    counts.tested += tested;
+    counts.passed += passed;
+}
+
+void count_hidden(driver_state& state, int x, int y, int triangles,
+    int blocks) {
+
+    fragment_counts& counts = get_tile_counts(state, x, y);
+
+    counts.hidden_triangles += triangles;
+    counts.hidden_blocks += blocks;
+}
+
+fragment_counts get_fragment_counts(const driver_state& state, bool prepass) {
+    const std::vector<fragment_counts>& tiles = prepass
+        ? state.tile_prepass_fragments : state.tile_fragments;
+    fragment_counts total;
+
+    for (unsigned i = 0; i < tiles.size(); i++) {
+        total.tested += tiles[i].tested;
+        total.passed += tiles[i].passed;
+        total.hidden_triangles += tiles[i].hidden_triangles;
+        total.hidden_blocks += tiles[i].hidden_blocks;
     }
 
-    // The triangle is completely outside of the plane so we don't need to
-    // do anything.
-    if (all_outside(inside)) { 
-        return; 
+    return total;
+}
+
+float get_block_farthest(driver_state& state, int bx, int by) {
+    depth_pyramid& hiz = state.hiz;
+    int index = bx + by * hiz.blocks_x;
+
+    if (hiz.block_dirty[index]) {
+        int x0 = bx * BLOCK_SIZE;
+        int y0 = by * BLOCK_SIZE;
+        int x1 = std::min(x0 + BLOCK_SIZE, state.image_width);
+        int y1 = std::min(y0 + BLOCK_SIZE, state.image_height);
+        float farthest = -FLT_MAX;
+
+        for (int y = y0; y < y1; y++) {
+            const float * row = state.image_depth + y * state.image_width;
+            for (int x = x0; x < x1; x++) {
+                farthest = std::max(farthest, row[x]);
+            }
+        }
+
+        hiz.block_farthest[index] = farthest;
+        hiz.block_dirty[index] = 0;
     }
 
-    // If at least one vertex is inside, then we need to clip
-    if (!all_inside(inside) && !all_outside(inside)) {
-        // Two vertices outside: (A, B, C) where 1 is inside and 0 outside
-        if (inside[0] && !inside[1] && !inside[2]) { // (1, 0, 0)
-            create_triangle_2_out(tris, axis, sign, V_A, V_B, V_C, state);
-        } else if (!inside[0] && inside[1] && !inside[2]) { // (0, 1, 0)
-            create_triangle_2_out(tris, axis, sign, V_B, V_C, V_A, state);
-        } else if (!inside[0] && !inside[1] && inside[2]) { // (0, 0, 1)
-            create_triangle_2_out(tris, axis, sign, V_C, V_A, V_B, state);
+    return hiz.block_farthest[index];
+}
+
+float get_tile_farthest(driver_state& state, int tx, int ty) {
+    depth_pyramid& hiz = state.hiz;
+    int index = tx + ty * hiz.tiles_x;
+
+    if (hiz.tile_dirty[index]) {
+        int bx0 = tx * (TILE_SIZE / BLOCK_SIZE);
+        int by0 = ty * (TILE_SIZE / BLOCK_SIZE);
+        int bx1 = std::min(bx0 + TILE_SIZE / BLOCK_SIZE, hiz.blocks_x);
+        int by1 = std::min(by0 + TILE_SIZE / BLOCK_SIZE, hiz.blocks_y);
+        float farthest = -FLT_MAX;
+
+        for (int by = by0; by < by1; by++) {
+            for (int bx = bx0; bx < bx1; bx++) {
+                farthest = std::max(farthest,
+                    get_block_farthest(state, bx, by));
+            }
         }
-        // One vertex outside: (A, B, C) where 1 is inside and 0 outside
-        else if (!inside[0] && inside[1] && inside[2]) { // (0, 1, 1)
-            create_triangle_2_in(tris, axis, sign, V_A, V_B, V_C, state);
-        } else if (inside[0] && !inside[1] && inside[2]) { // (1, 0, 1)
-            create_triangle_2_in(tris, axis, sign, V_B, V_C, V_A, state);
-        } else if (inside[0] && inside[1] && !inside[2]) { // (1, 1, 0)
-            create_triangle_2_in(tris, axis, sign, V_C, V_A, V_B, state);
+
+        hiz.tile_farthest[index] = farthest;
+        hiz.tile_dirty[index] = 0;
+    }
+
+    return hiz.tile_farthest[index];
+}
+
+bool is_depth_hidden(const driver_state& state, float nearest,
+    float farthest) {
+
+    // A fragment exactly at the farthest depth still passes an equal test
+    if (state.depth_test == depth_func::equal) {
+        return nearest > farthest;
+    }
+    return nearest >= farthest;
+}
+
+bool is_rect_hidden(driver_state& state, const triangle_setup& setup,
+    int x0, int y0, int x1, int y1) {
+
+    int min_x = std::max(setup.min_x, x0);
+    int min_y = std::max(setup.min_y, y0);
+    int max_x = std::min(setup.max_x, x1);
+    int max_y = std::min(setup.max_y, y1);
+
+    for (int by = min_y / BLOCK_SIZE; by <= max_y / BLOCK_SIZE; by++) {
+        for (int bx = min_x / BLOCK_SIZE; bx <= max_x / BLOCK_SIZE; bx++) {
+            if (!is_depth_hidden(state, setup.nearest_depth,
+                get_block_farthest(state, bx, by))) {
+                return false;
+            }
         }
     }
 
-    // Clip each triangle we've created against the next plane
-    for (unsigned i = 0; i < tris.size(); i++) {
-        clip_triangle(state,(const data_geometry **)(&(tris[i])),face+1);
-    }
-    
-    clear_data_geos(tris);
+    return true;
 }
 
-// Rasterize the triangle defined by the three vertices in the "in" array.  This
-// function is responsible for rasterization, interpolation of data to
-// fragments, calling the fragment shader, and z-buffering.
-void rasterize_triangle(driver_state& state, const data_geometry* in[3])
-{
-    unsigned pixel_index;
-    // x and y correspond to the x and y pixel coordinates for each
-    // vertex of the triangle.
-    float x[VERT_PER_TRI];
-    float y[VERT_PER_TRI];
 
-    // z holds the perspective transformed z coordinates for each vertex
-    float z[VERT_PER_TRI];
-    float depth;
+/**************************************************************************/
+/* Rasterize Triangle Helpers */
+/**************************************************************************/
+
+bool setup_triangle(driver_state& state, const data_geometry* in[3],
+    triangle_setup& setup) {
 
+    float * x = setup.x;
+    float * y = setup.y;
     float min_x, min_y;
     float max_x, max_y;
 
-    
-    // k0, k1, and k2 are the coefficients for the calculations of the
-    // areas for the barycentric coordinates
-    float k0[VERT_PER_TRI];
-    float k1[VERT_PER_TRI];
-    float k2[VERT_PER_TRI]; 
-    float total_area;
-    float bary[VERT_PER_TRI];
-
-    // Define and alloc the data_frag for later
-    data_fragment frag;
-    // Allocate an array to hold the interpolated data
-    frag.data = new float[MAX_FLOATS_PER_VERTEX];
-    
-
     // Calculate pixel coords of vertices
-    for (int iter = 0; iter < VERT_PER_TRI; iter++) {
+    for (int i = 0; i < VERT_PER_TRI; i++) {
         // Conversion to homogenous coords (for x and y) is done in this
-        // function. Do not forget to do it for z.
-        calc_pixel_coords(state, (*in)[iter], x[iter], y[iter]);
+        // function.
+        calc_pixel_coords(state, (*in)[i], x[i], y[i]);
     }
 
-    // Draw the triangle
-    // First barycentric weights
-    total_area = .5f * ((x[V_B] * y[V_C] - x[V_C] * y[V_B]) 
-                        - (x[V_A] * y[V_C] - x[V_C] * y[V_A])
-                        + (x[V_A] * y[V_B] - x[V_B] * y[V_A]));
-
-    // These are constant for all pixels so let's calculate them ahead of
-    // time.
-    k0[V_A] = x[V_B] * y[V_C] - x[V_C] * y[V_B];
-    k1[V_A] = y[V_B] - y[V_C];
-    k2[V_A] = x[V_C] - x[V_B];
-
-    k0[V_B] = x[V_C] * y[V_A] - x[V_A] * y[V_C];
-    k1[V_B] = y[V_C] - y[V_A];
-    k2[V_B] = x[V_A] - x[V_C];
-
-    k0[V_C] = x[V_A] * y[V_B] - x[V_B] * y[V_A];
-    k1[V_C] = y[V_A] - y[V_B];
-    k2[V_C] = x[V_B] - x[V_A];
+    setup.snapped = false;
+    if (state.subpixel_bits > 0 && !snap_triangle(state, setup)) {
+        return false;
+    }
 
-    // Calculate the min and max coordinates to iterate through
     calc_min_coord(state, x, y, min_x, min_y);
     calc_max_coord(state, x, y, max_x, max_y);
 
+    // The rasterizer visits every integer coordinate c with
+    // min + 1 <= c < max + 1
+    setup.min_x = min_x + 1;
+    setup.min_y = min_y + 1;
+    setup.max_x = (int)std::ceil(max_x + 1) - 1;
+    setup.max_y = (int)std::ceil(max_y + 1) - 1;
+
+    float total_area = .5f * ((x[V_B] * y[V_C] - x[V_C] * y[V_B])
+                              - (x[V_A] * y[V_C] - x[V_C] * y[V_A])
+                              + (x[V_A] * y[V_B] - x[V_B] * y[V_A]));
+
+    // A triangle with no area has no pixels inside of it
+    if (total_area == 0 || setup.min_x > setup.max_x
+        || setup.min_y > setup.max_y) {
+        return false;
+    }
 
-    // Iterate through each pixel and calculate the barycentric weights for
-    // each.
-    for (int y = min_y + 1; y < max_y + 1; y++) {
-        for (int x = min_x + 1; x < max_x + 1; x++) {
-            for (int vert = 0; vert < VERT_PER_TRI; vert++) {
-                // Calculation is not done doing the iterative approach
-                // We're multiplying every time to find the barycentric
-                bary[vert] = .5f * (k0[vert] + (k1[vert] * x) 
-                    + (k2[vert] * y)) / total_area;
-            }
+    // Fold the 1/2 and the division by the total area into the edge
+    // functions so every pixel only needs multiply-adds
+    float inv_area = .5f / total_area;
 
+    setup.k0[V_A] = (x[V_B] * y[V_C] - x[V_C] * y[V_B]) * inv_area;
+    setup.k1[V_A] = (y[V_B] - y[V_C]) * inv_area;
+    setup.k2[V_A] = (x[V_C] - x[V_B]) * inv_area;
 
-            calc_z_coords(in, z);
-            depth = calc_depth_at(z, bary);
-    
-            pixel_index = x + y * state.image_width;
+    setup.k0[V_B] = (x[V_C] * y[V_A] - x[V_A] * y[V_C]) * inv_area;
+    setup.k1[V_B] = (y[V_C] - y[V_A]) * inv_area;
+    setup.k2[V_B] = (x[V_A] - x[V_C]) * inv_area;
 
-            // Only draw if the pixel is inside the triangle and it is the
-            // closest triangle to the camera
-            if (is_pixel_inside(bary) && 
-                depth < state.image_depth[pixel_index]) {
+    setup.k0[V_C] = (x[V_A] * y[V_B] - x[V_B] * y[V_A]) * inv_area;
+    setup.k1[V_C] = (y[V_A] - y[V_B]) * inv_area;
+    setup.k2[V_C] = (x[V_B] - x[V_A]) * inv_area;
 
-                state.image_color[pixel_index] =
-                    get_pixel_color(state, frag, in, bary);
-                state.image_depth[pixel_index] = depth;
-            }
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        for (int j = 0; j < RASTER_STEP; j++) {
+            setup.x_step[i][j] = setup.k1[i] * j;
         }
     }
 
-    // Don't forget to delete our allocated memory!  
-    delete[] frag.data;
-
-}
-
+    calc_z_coords(in, setup.z);
 
-/**************************************************************************/
-/* Initialization */
-/**************************************************************************/
-
-void set_render_black(driver_state& state) {
-    for (int i = 0; i < state.image_len; i++) {
-        state.image_color[i] = make_pixel(0, 0, 0);
+    // The computed weights of a pixel are off by at most a few rounding
+    // errors of the terms that make them up, so their sum is within
+    // bary_error of 1.  Every pixel that passes the inside test has
+    // non-negative weights, which bounds its depth from below.
+    float bary_error = 0;
+    float z_min = setup.z[V_A];
+    float z_abs = 0;
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        bary_error += 4 * FLT_EPSILON * (std::fabs(setup.k0[i])
+            + std::fabs(setup.k1[i]) * (setup.max_x + RASTER_STEP)
+            + std::fabs(setup.k2[i]) * (setup.max_y + 1));
+        z_min = std::min(z_min, setup.z[i]);
+        z_abs = std::max(z_abs, std::fabs(setup.z[i]));
     }
+    setup.nearest_depth = z_min - std::fabs(z_min) * bary_error
+        - 4 * FLT_EPSILON * z_abs * (1 + bary_error);
+
+    // The integer inside test can accept pixels whose computed weights are
+    // slightly negative, which could put their depth below the bound by as
+    // much as z_abs * bary_error
+    if (setup.snapped) {
+        setup.nearest_depth -= z_abs * bary_error;
+    }
+
+    return true;
 }
 
-void init_image_depth(driver_state& state) {
-    for (int i = 0; i < state.image_len; i++) {
-        state.image_depth[i] = FLT_MAX;
-    }
+double calc_edge_at(const triangle_setup& setup, int vert, int x, int y) {
+    return (double)setup.k0[vert] + (double)setup.k1[vert] * x
+        + (double)setup.k2[vert] * y;
 }
 
+float calc_run_start(const triangle_setup& setup, int vert, int x, int y) {
+    return setup.k0[vert] + setup.k2[vert] * y + setup.k1[vert] * x;
+}
 
-/**************************************************************************/
-/* Render Helpers */
-/**************************************************************************/
+void setup_attribute_planes(const driver_state& state,
+    const data_geometry* in[3], const triangle_setup& setup,
+    attribute_planes& planes) {
 
-void fill_data_geo_triangle(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index) {
-    
+    // Since the edge functions evaluate to the barycentric weights, the
+    // gradient of any value v interpolated over the triangle is the sum of
+    // v[i] times the gradient of weight i.
+    float inv_w[VERT_PER_TRI];
     for (int i = 0; i < VERT_PER_TRI; i++) {
-        (*data_geos)[i].data = state.vertex_data + vert_index;
-        vert_index += state.floats_per_vertex;
+        inv_w[i] = 1.0f / (*in)[i].gl_Position[W];
     }
-    
-}
 
-void fill_data_geos_indexed(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index) {
-    
-    for (int i = 0; i < VERT_PER_TRI; i++) {
-        (*data_geos)[i].data = state.vertex_data 
-            + state.index_data[vert_index] * state.floats_per_vertex;
-        vert_index++;
-    }
-}
+    planes.x0 = setup.x[V_A];
+    planes.y0 = setup.y[V_A];
+
+    planes.w_c = inv_w[V_A];
+    planes.w_dx = inv_w[V_A] * setup.k1[V_A] + inv_w[V_B] * setup.k1[V_B]
+        + inv_w[V_C] * setup.k1[V_C];
+    planes.w_dy = inv_w[V_A] * setup.k2[V_A] + inv_w[V_B] * setup.k2[V_B]
+        + inv_w[V_C] * setup.k2[V_C];
+
+    for (int i = 0; i < state.floats_per_vertex; i++) {
+        float v[VERT_PER_TRI];
+
+        for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+            v[vert] = (*in)[vert].data[i];
+        }
+
+        switch (state.interp_rules[i]) {
+        case interp_type::flat:
+            planes.c[i] = v[V_A];
+            planes.dx[i] = 0;
+            planes.dy[i] = 0;
+            continue;
+
+        // Perspective correct interpolation is linear in screen space for
+        // data/w
+        case interp_type::smooth:
+            for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                v[vert] *= inv_w[vert];
+            }
+            break;
+
+        case interp_type::noperspective:
+            break;
 
-void fill_data_geos_fan(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index) {
+        default:
+            std::cerr << "ERROR: Invalid interp_type specified.\n";
+            break;
+        }
 
-    for (int i = 1; i < VERT_PER_TRI; i++) {
-        (*data_geos)[i].data = state.vertex_data + (vert_index
-            * state.floats_per_vertex);
-        vert_index++;
+        planes.c[i] = v[V_A];
+        planes.dx[i] = v[V_A] * setup.k1[V_A] + v[V_B] * setup.k1[V_B]
+            + v[V_C] * setup.k1[V_C];
+        planes.dy[i] = v[V_A] * setup.k2[V_A] + v[V_B] * setup.k2[V_B]
+            + v[V_C] * setup.k2[V_C];
     }
-    vert_index--;
 }
 
-void fill_data_geos_strip(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index, int iteration) {
-    
-    if (iteration % 2) {
-        (*data_geos)[V_A].data = (*data_geos)[V_B].data;
-        (*data_geos)[V_B].data = state.vertex_data + vert_index;
-    } else {
-        (*data_geos)[V_A].data = (*data_geos)[V_C].data;
-        (*data_geos)[V_C].data = state.vertex_data + vert_index;
+void setup_triangle_shading(const driver_state& state,
+    const data_geometry* in[3], const triangle_setup& setup, bool shade_once,
+    attribute_planes& planes) {
+
+    if (shade_once && state.fragment_shader_constant) {
+        planes.color = state.constant_color;
+        return;
     }
 
-    vert_index += state.floats_per_vertex;
+    setup_attribute_planes(state, in, setup, planes);
+    if (shade_once) {
+        shade_triangle_once(state, planes);
+    }
 }
 
-void calc_data_geo_pos(driver_state& state, data_geometry * data_geos[3]) {
-    data_vertex data_vert;
-    for (int i = 0; i < VERT_PER_TRI; i++) {
-        data_vert.data = (*data_geos)[i].data;
-        state.vertex_shader(data_vert, (*data_geos)[i], state.uniform_data);
+void calc_bary_run(const triangle_setup& setup, int x, int y, int count,
+    float bary[][VERT_PER_TRI]) {
+
+    for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+        float start = calc_run_start(setup, vert, x, y);
+
+        for (int i = 0; i < count; i++) {
+            bary[i][vert] = start + setup.x_step[vert][i];
+        }
     }
 }
 
-/**************************************************************************/
-/* Rasterize Triangle Helpers */
-/**************************************************************************/
-
 void calc_pixel_coords(driver_state& state, const data_geometry& data_geo, 
     float & i, float & j) {
     
@@ -393,6 +1607,77 @@ void calc_max_coord(const driver_state& state, float * x, float * y,
     max_y = std::min(max_y, state.image_height - 1.0f);
 }
 
+bool snap_triangle(const driver_state& state, triangle_setup& setup) {
+    long long scale = 1ll << state.subpixel_bits;
+    long long gx[VERT_PER_TRI];
+    long long gy[VERT_PER_TRI];
+
+    // Round to the grid.  The snapped positions are exactly representable,
+    // so the floating point setup sees the same triangle as the integer
+    // edge functions.
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        gx[i] = std::llround((double)setup.x[i] * scale);
+        gy[i] = std::llround((double)setup.y[i] * scale);
+        setup.x[i] = (double)gx[i] / scale;
+        setup.y[i] = (double)gy[i] / scale;
+    }
+
+    // The edge function of vertex i is zero along the opposite edge, in the
+    // same form as the floating point setup.  Pixel centers are integers, so
+    // a and b are scaled to evaluate at grid position (x * scale, y * scale).
+    long long area2 = 0;
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        int j = (i + 1) % VERT_PER_TRI;
+        int k = (i + 2) % VERT_PER_TRI;
+
+        setup.edge_a[i] = (gy[j] - gy[k]) * scale;
+        setup.edge_b[i] = (gx[k] - gx[j]) * scale;
+        setup.edge_c[i] = gx[j] * gy[k] - gx[k] * gy[j];
+        area2 += setup.edge_c[i];
+    }
+
+    if (area2 == 0) {
+        return false;
+    }
+
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        // Flip clockwise triangles so the inside is always positive
+        if (area2 < 0) {
+            setup.edge_a[i] = -setup.edge_a[i];
+            setup.edge_b[i] = -setup.edge_b[i];
+            setup.edge_c[i] = -setup.edge_c[i];
+        }
+
+        // Pixels exactly on a left edge (the inside is towards +x) or a top
+        // edge (horizontal, with the inside below it) are inside, others on
+        // an edge are not.  y grows upwards (row 0 is the bottom row), so
+        // below is towards -y.  Adding one turns > 0 into >= 0 for them.
+        if (setup.edge_a[i] > 0 || (setup.edge_a[i] == 0
+            && setup.edge_b[i] < 0)) {
+            setup.edge_c[i]++;
+        }
+    }
+
+    setup.snapped = true;
+    return true;
+}
+
+bool is_sample_covered(const triangle_setup& setup, int x, int y,
+    float * bary) {
+
+    if (!setup.snapped) {
+        return is_pixel_inside(bary);
+    }
+
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        if (setup.edge_a[i] * x + setup.edge_b[i] * y + setup.edge_c[i] <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool is_pixel_inside(float * bary_weights) {
     for (int i = 0; i < VERT_PER_TRI; i++) {
         if (bary_weights[i] < 0) {
@@ -408,47 +1693,100 @@ bool is_pixel_inside(float * bary_weights) {
 /* Fragment Shader */
 /**************************************************************************/
 
-pixel get_pixel_color(driver_state& state, data_fragment& frag,
-    const data_geometry * data_geos[3], float * screen_bary) {
-    
-    float world_bary[VERT_PER_TRI];
-    data_output out;
+void build_interp_plan(driver_state& state) {
+    interp_plan& plan = state.plan;
+
+    plan.num_flat = 0;
+    plan.num_varying = 0;
+    plan.needs_w = false;
 
-    // For each float in the vertex we have to interpolate data depending
-    // on the interp_rule associated with it.
     for (int i = 0; i < state.floats_per_vertex; i++) {
-        switch (state.interp_rules[i]) {
-        
-        // If the interpolation rule is flat then set all data floats equal
-        // to the data of the first vertex
+        interp_type type = state.interp_rules[i];
+        interp_run * runs = plan.varying;
+        int * num_runs = &plan.num_varying;
+
+        switch (type) {
         case interp_type::flat:
-            frag.data[i] = (*data_geos)[V_A].data[i];
+            runs = plan.flat;
+            num_runs = &plan.num_flat;
             break;
 
-        // If the interpolation rule is smooth then we want perspective
-        // correct interpolation
         case interp_type::smooth:
-            // Convert the bary centric coordinates we calculated previously
-            // in screen space back to world space
-            convert_from_screen(screen_bary, world_bary, data_geos);
-            frag.data[i] = interpolate_fragment_at(i, data_geos, 
-                world_bary);
+            plan.needs_w = true;
             break;
 
-        // If the interpolation rule is noperspective then we just want
-        // interpolation based on our screen space barycentric coordinates
         case interp_type::noperspective:
-            frag.data[i] = interpolate_fragment_at(i, data_geos,
-                screen_bary);
             break;
 
         default:
             std::cerr << "ERROR: Invalid interp_type specified.\n";
-            break;
+            continue;
+        }
+
+        // Extend the last run when this float continues it
+        if (*num_runs > 0 && runs[*num_runs - 1].type == type
+            && runs[*num_runs - 1].end == i) {
+            runs[*num_runs - 1].end++;
+        } else {
+            runs[*num_runs].type = type;
+            runs[*num_runs].first = i;
+            runs[*num_runs].end = i + 1;
+            (*num_runs)++;
+        }
+    }
+}
+
+void set_flat_data(const driver_state& state, const attribute_planes& planes,
+    float * data) {
+
+    for (int r = 0; r < state.plan.num_flat; r++) {
+        const interp_run& run = state.plan.flat[r];
+        std::copy(planes.c + run.first, planes.c + run.end, data + run.first);
+    }
+}
+
+pixel get_pixel_color(driver_state& state, data_fragment& frag,
+    const attribute_planes& planes, int x, int y) {
+    
+    const interp_plan& plan = state.plan;
+    float px = x - planes.x0;
+    float py = y - planes.y0;
+
+    // Recover w from the interpolated 1/w; smooth data is multiplied by it
+    // to undo the division done during setup.
+    float w = 0;
+    if (plan.needs_w) {
+        w = 1.0f / (planes.w_c + planes.w_dx * px + planes.w_dy * py);
+    }
+
+    // Flat data was stored by set_flat_data, so only the runs that vary over
+    // the triangle are interpolated here.
+    for (int r = 0; r < plan.num_varying; r++) {
+        const interp_run& run = plan.varying[r];
+
+        // Smooth runs get perspective correct interpolation
+        if (run.type == interp_type::smooth) {
+            for (int i = run.first; i < run.end; i++) {
+                frag.data[i] = (planes.c[i] + planes.dx[i] * px
+                    + planes.dy[i] * py) * w;
+            }
+        }
+        // Noperspective runs are interpolated in screen space
+        else {
+            for (int i = run.first; i < run.end; i++) {
+                frag.data[i] = planes.c[i] + planes.dx[i] * px
+                    + planes.dy[i] * py;
+            }
         }
     }
 
     // Call our fragment shader with the data we just interpolated
+    return run_fragment_shader(state, frag);
+}
+
+pixel run_fragment_shader(const driver_state& state, data_fragment& frag) {
+    data_output out;
+
     state.fragment_shader(frag, out, state.uniform_data);
 
     // Multiply the output by C_MAX (255) because output_color returns a
@@ -457,30 +1795,171 @@ pixel get_pixel_color(driver_state& state, data_fragment& frag,
         * C_MAX, out.output_color[C_B] * C_MAX);
 }
 
+void shade_triangle_once(const driver_state& state,
+    attribute_planes& planes) {
 
-float interpolate_fragment_at(unsigned index,
-    const data_geometry * data_geos[3], float * bary) {
-    float ret = 0;
+    float frag_data[MAX_FLOATS_PER_VERTEX];
+    data_fragment frag;
+    frag.data = frag_data;
 
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        ret += bary[i] * (*data_geos)[i].data[index];
+    set_flat_data(state, planes, frag_data);
+    planes.color = run_fragment_shader(state, frag);
+}
+
+pixel calc_constant_color(const driver_state& state) {
+    // The shader ignores its inputs, but give it defined data anyway
+    float frag_data[MAX_FLOATS_PER_VERTEX] = {};
+    data_fragment frag;
+    frag.data = frag_data;
+
+    return run_fragment_shader(state, frag);
+}
+
+void shade_span(driver_state& state, const attribute_planes& planes, int x,
+    int y, int count, unsigned mask) {
+
+    const interp_plan& plan = state.plan;
+    float data[MAX_FLOATS_PER_VERTEX][MAX_SPAN];
+    float px[MAX_SPAN];
+    float w[MAX_SPAN];
+    data_fragment_span in;
+    data_output_span out;
+    float py = y - planes.y0;
+
+    in.x = x;
+    in.y = y;
+    in.count = count;
+    in.mask = mask;
+    in.data = data;
+
+    // Every pixel of the span is interpolated, covered or not, so the loops
+    // have a fixed length.  The arithmetic matches get_pixel_color's.
+    for (int j = 0; j < MAX_SPAN; j++) {
+        px[j] = (x + j) - planes.x0;
+    }
+    if (plan.needs_w) {
+        for (int j = 0; j < MAX_SPAN; j++) {
+            w[j] = 1.0f / (planes.w_c + planes.w_dx * px[j]
+                + planes.w_dy * py);
+        }
     }
 
-    return ret;
+    for (int r = 0; r < plan.num_flat; r++) {
+        const interp_run& run = plan.flat[r];
+        for (int i = run.first; i < run.end; i++) {
+            for (int j = 0; j < MAX_SPAN; j++) {
+                data[i][j] = planes.c[i];
+            }
+        }
+    }
+
+    for (int r = 0; r < plan.num_varying; r++) {
+        const interp_run& run = plan.varying[r];
+        for (int i = run.first; i < run.end; i++) {
+            for (int j = 0; j < MAX_SPAN; j++) {
+                data[i][j] = planes.c[i] + planes.dx[i] * px[j]
+                    + planes.dy[i] * py;
+            }
+            if (run.type == interp_type::smooth) {
+                for (int j = 0; j < MAX_SPAN; j++) {
+                    data[i][j] *= w[j];
+                }
+            }
+        }
+    }
+
+    state.fragment_shader_span(in, out, state.uniform_data);
+
+    unsigned pixel_index = x + y * state.image_width;
+    for (int j = 0; j < count; j++) {
+        if (!(mask & (1u << j))) {
+            continue;
+        }
+
+        state.image_color[pixel_index + j] = make_pixel(
+            out.output_color[C_R][j] * C_MAX,
+            out.output_color[C_G][j] * C_MAX,
+            out.output_color[C_B][j] * C_MAX);
+    }
 }
 
-void convert_from_screen(float * screen_bary, float * world_bary, 
-    const data_geometry * data_geos[3]) {
-    float k = 0;
+void interpolate_quad(const driver_state& state,
+    const attribute_planes& planes, int x, int y,
+    float data[][MAX_FLOATS_PER_VERTEX], float * dFdx, float * dFdy) {
 
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        k += screen_bary[i] / (*data_geos)[i].gl_Position[W];
+    static const int QUAD_PIXELS = 4;
+
+    const interp_plan& plan = state.plan;
+    float px[QUAD_PIXELS];
+    float py[QUAD_PIXELS];
+    float w[QUAD_PIXELS];
+
+    for (int p = 0; p < QUAD_PIXELS; p++) {
+        px[p] = (x + p % 2) - planes.x0;
+        py[p] = (y + p / 2) - planes.y0;
+    }
+    if (plan.needs_w) {
+        for (int p = 0; p < QUAD_PIXELS; p++) {
+            w[p] = 1.0f / (planes.w_c + planes.w_dx * px[p]
+                + planes.w_dy * py[p]);
+        }
     }
 
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        world_bary[i] = screen_bary[i] / ((*data_geos)[i].gl_Position[W]
-            * k);
+    for (int r = 0; r < plan.num_flat; r++) {
+        const interp_run& run = plan.flat[r];
+        for (int i = run.first; i < run.end; i++) {
+            for (int p = 0; p < QUAD_PIXELS; p++) {
+                data[p][i] = planes.c[i];
+            }
+        }
+    }
+
+    for (int r = 0; r < plan.num_varying; r++) {
+        const interp_run& run = plan.varying[r];
+        for (int i = run.first; i < run.end; i++) {
+            for (int p = 0; p < QUAD_PIXELS; p++) {
+                data[p][i] = planes.c[i] + planes.dx[i] * px[p]
+                    + planes.dy[i] * py[p];
+            }
+            if (run.type == interp_type::smooth) {
+                for (int p = 0; p < QUAD_PIXELS; p++) {
+                    data[p][i] *= w[p];
+                }
+            }
+        }
+    }
+
+    // Coarse derivatives: the whole quad shares the differences along its
+    // top row and left column
+    for (int i = 0; i < state.floats_per_vertex; i++) {
+        dFdx[i] = data[1][i] - data[0][i];
+        dFdy[i] = data[2][i] - data[0][i];
+    }
+}
+
+pixel_shader select_pixel_shader(const driver_state& state) {
+    // Spell interp_rules the way the vertex_data command does
+    std::string rules;
+    for (int i = 0; i < state.floats_per_vertex; i++) {
+        switch (state.interp_rules[i]) {
+        case interp_type::flat: rules += 'f'; break;
+        case interp_type::smooth: rules += 's'; break;
+        case interp_type::noperspective: rules += 'n'; break;
+        default: return get_pixel_color;
+        }
+    }
+
+    for (unsigned i = 0; i < pipeline_specializations.size(); i++) {
+        const pipeline_specialization& spec = pipeline_specializations[i];
+
+        if (spec.vertex_shader == state.vertex_shader
+            && spec.fragment_shader == state.fragment_shader
+            && spec.interp_rules == rules) {
+            return spec.shade_pixel;
+        }
     }
+
+    return get_pixel_color;
 }
 
 
@@ -496,7 +1975,7 @@ void calc_z_coords(const data_geometry * data_geos[3], float * z) {
     }
 }
 
-float calc_depth_at(float * z, float * bary) {
+float calc_depth_at(const float * z, const float * bary) {
     float ret = 0;
 
     for (unsigned i = 0; i < VERT_PER_TRI; i++) {
@@ -510,85 +1989,50 @@ float calc_depth_at(float * z, float * bary) {
 /**************************************************************************/
 /* Clipping */
 /**************************************************************************/
-void clear_data_geos(std::vector<data_geometry *>& tris) {
-    for (unsigned i = 0; i < tris.size(); i++) {
-        remove_data_geo(i, tris);
+bool is_face_culled(const driver_state& state, const data_geometry* in[3]) {
+    const vec4& a = (*in)[V_A].gl_Position;
+    const vec4& b = (*in)[V_B].gl_Position;
+    const vec4& c = (*in)[V_C].gl_Position;
+
+    // The determinant of the x, y and w coordinates has the sign of the
+    // screen space area times the signs of the three w's.  Unlike the area
+    // it needs no division by w, so it can be taken before clipping.
+    double det = (double)a[X] * ((double)b[Y] * c[W] - (double)c[Y] * b[W])
+        - (double)b[X] * ((double)a[Y] * c[W] - (double)c[Y] * a[W])
+        + (double)c[X] * ((double)a[Y] * b[W] - (double)b[Y] * a[W]);
+
+    if (det == 0) {
+        return true;
     }
 
-    tris.clear();
-}
+    bool front = (det > 0) == (state.front_face == winding::ccw);
 
-void remove_data_geo(unsigned index, std::vector<data_geometry *>& tris) {
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        delete[] tris[index][i].data;
-    }
-    delete[] tris[index];
-    tris.erase(tris.begin() + index);
+    return front == (state.cull_mode == cull_face::front);
 }
 
-void add_data_geos(const driver_state& state, 
-    std::vector<data_geometry *>& tris, 
-    const data_geometry * data_geos[3]) {
+unsigned calc_outcode(const vec4& position) {
+    unsigned outcode = 0;
 
-    tris.push_back(new data_geometry[VERT_PER_TRI]);
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        tris[tris.size() - 1][i].data = new float[MAX_FLOATS_PER_VERTEX];
-        for (unsigned j = 0; j < DATA_PER_COORD; j++) {
-            tris[tris.size() - 1][i].gl_Position[j] =
-                (*data_geos)[i].gl_Position[j];
+    for (int face = 0; face < NUM_CLIP_FACES; face++) {
+        if (calc_plane_distance(position, face) < 0) {
+            outcode |= 1u << face;
         }
-
-        copy_data_geos_data(state, (*data_geos)[i],
-            tris[tris.size() - 1][i]);
-    }
-}
-
-void add_data_geos(std::vector<data_geometry *>& tris, const vec4& a, 
-    const vec4& b, const vec4& c) {
-
-    data_geometry * geos = new data_geometry[VERT_PER_TRI];
-
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        geos[i].data = new float[MAX_FLOATS_PER_VERTEX];
     }
 
-    geos[V_A].gl_Position = a;
-    geos[V_B].gl_Position = b;
-    geos[V_C].gl_Position = c;
-
-    tris.push_back(geos);
-}
-
-void copy_data_geos_data(const driver_state& state,
-    const data_geometry& from, data_geometry& to) {
-
-    for (int i = 0; i < state.floats_per_vertex; i++) {
-        to.data[i] = from.data[i];
-    }
+    return outcode;
 }
 
-void copy_data_geos_data(const driver_state& state, 
-    const data_geometry * from[3], data_geometry * to[3], unsigned a,
-    unsigned b, unsigned c) {
-
-    copy_data_geos_data(state, (*from)[a], (*to)[V_A]);
-    copy_data_geos_data(state, (*from)[b], (*to)[V_B]);
-    copy_data_geos_data(state, (*from)[c], (*to)[V_C]);
-}
+bool is_inside_guard_band(const data_geometry* in[3]) {
+    for (int i = 0; i < VERT_PER_TRI; i++) {
+        const vec4& p = (*in)[i].gl_Position;
+        float limit = GUARD_BAND_SIZE * p[W];
 
-bool all_inside(bool * inside) {
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        if (!inside[i]) {
+        // Vertices behind the eye have no meaningful screen position
+        if (!(p[W] > 0)) {
             return false;
         }
-    }
 
-    return true;
-}
-
-bool all_outside(bool * inside) {
-    for (unsigned i = 0; i < VERT_PER_TRI; i++) {
-        if (inside[i]) {
+        if (std::fabs(p[X]) > limit || std::fabs(p[Y]) > limit) {
             return false;
         }
     }
@@ -596,141 +2040,75 @@ bool all_outside(bool * inside) {
     return true;
 }
 
-void create_triangle_2_out(std::vector<data_geometry *>& tris,
-    unsigned axis, int sign, unsigned in_index, unsigned out0_index,
-    unsigned out1_index, const driver_state& state) {
-    
-    data_geometry a = tris[0][in_index];
-    data_geometry b = tris[0][out0_index];
-    data_geometry c = tris[0][out1_index];
-
-    float b_numer = sign * b.gl_Position[W] - b.gl_Position[axis];
-    float ab_weight = b_numer / ((a.gl_Position[axis]
-        - sign * a.gl_Position[W]) + b_numer);
-    float c_numer = sign * c.gl_Position[W] - c.gl_Position[axis];
-    float ac_weight = c_numer / ((a.gl_Position[axis] 
-        - sign * a.gl_Position[W]) + c_numer);
-
-    float ab_nop_weight = ab_weight * tris[0][in_index].gl_Position[W]
-                * calc_noperspective_weight(ab_weight, 
-                    tris[0][in_index].gl_Position[W], 
-                    tris[0][out0_index].gl_Position[W]);
-    float ac_nop_weight = ac_weight * tris[0][in_index].gl_Position[W]
-                * calc_noperspective_weight(ac_weight,
-                    tris[0][in_index].gl_Position[W],
-                    tris[0][out1_index].gl_Position[W]);
-
-    vec4 ab = ab_weight * a.gl_Position + (1 - ab_weight) * b.gl_Position;
-    vec4 ac = ac_weight * a.gl_Position + (1 - ac_weight) * c.gl_Position;
+float calc_plane_distance(const vec4& position, int face) {
+    // Even faces are the planes axis = -w and odd faces are axis = w
+    int axis = face % 3;
 
+    if (face % 2) {
+        return position[W] - position[axis];
+    }
+    return position[W] + position[axis];
+}
 
-    add_data_geos(tris, a.gl_Position, ab, ac);
-    copy_data_geos_data(state, (const data_geometry **)(&(tris[0])),
-        &(tris[1]), in_index, out0_index, out1_index);
+int clip_polygon(const driver_state& state, const clip_vertex * in,
+    int count, clip_vertex * out, int face) {
 
+    int out_count = 0;
 
-    // All interp_types copy the inside index to the a vertex
-    copy_data_geos_data(state, tris[0][in_index], tris[1][V_A]);
-    
-    for (int i = 0; i < state.floats_per_vertex; i++) {
-        switch (state.interp_rules[i]) {
-        case interp_type::flat:
-            for (unsigned j = 1; j < VERT_PER_TRI; j++) {
-                tris[1][j].data[i] = tris[0][in_index].data[i];
-            }
-            break;
-    
-        case interp_type::smooth:
-            tris[1][V_B].data[i] = interpolate_data(ab_weight,
-                tris[0][in_index].data[i], tris[0][out0_index].data[i]);
-                
-            tris[1][V_C].data[i] = interpolate_data(ac_weight,
-                tris[0][in_index].data[i], tris[0][out1_index].data[i]);
-            break;
+    // Sutherland-Hodgman: walk the edges of the polygon, keeping the inside
+    // vertices and adding a vertex wherever an edge crosses the plane.
+    for (int i = 0; i < count; i++) {
+        const clip_vertex& a = in[i];
+        const clip_vertex& b = in[(i + 1) % count];
+        float a_dist = calc_plane_distance(a.gl_Position, face);
+        float b_dist = calc_plane_distance(b.gl_Position, face);
 
-        case interp_type::noperspective:
-            tris[1][V_B].data[i] = interpolate_data(ab_nop_weight,
-                tris[0][in_index].data[i], tris[0][out0_index].data[i]);
-                
-            tris[1][V_C].data[i] = interpolate_data(ac_nop_weight,
-                tris[0][in_index].data[i], tris[0][out1_index].data[i]);
-            break;
+        if (a_dist >= 0) {
+            out[out_count].gl_Position = a.gl_Position;
+            std::copy(a.data, a.data + state.floats_per_vertex,
+                out[out_count].data);
+            out_count++;
+        }
 
-        default:
-            std::cerr << "ERROR: Invalid interp_type specified.\n";
-            break;
+        if ((a_dist >= 0) != (b_dist >= 0)) {
+            interpolate_clip_vertex(state, a, b, a_dist / (a_dist - b_dist),
+                out[out_count]);
+            out_count++;
         }
     }
-    remove_data_geo(0, tris);
+
+    return out_count;
 }
 
-void create_triangle_2_in(std::vector<data_geometry *>& tris,
-    unsigned axis, int sign, unsigned out_index, unsigned in0_index,
-    unsigned in1_index, const driver_state& state) {
+void interpolate_clip_vertex(const driver_state& state, const clip_vertex& a,
+    const clip_vertex& b, float t, clip_vertex& out) {
+
+    // interpolate_data weights its first argument, so the weight of a is 1 - t
+    float a_weight = 1 - t;
+    float nop_weight = a_weight * a.gl_Position[W]
+        * calc_noperspective_weight(a_weight, a.gl_Position[W],
+            b.gl_Position[W]);
+
+    out.gl_Position = a_weight * a.gl_Position + t * b.gl_Position;
 
-    
-    data_geometry a = tris[0][out_index];
-    data_geometry b = tris[0][in0_index];
-    data_geometry c = tris[0][in1_index];
-
-    float b_numer = sign * b.gl_Position[W] - b.gl_Position[axis];
-    float ab_weight = b_numer / ((a.gl_Position[axis]
-        - sign * a.gl_Position[W]) + b_numer);
-    float c_numer = sign * c.gl_Position[W] - c.gl_Position[axis];
-    float ac_weight = c_numer / ((a.gl_Position[axis] 
-        - sign * a.gl_Position[W]) + c_numer);
-
-    float ab_nop_weight = ab_weight * tris[0][out_index].gl_Position[W]
-                * calc_noperspective_weight(ab_weight, 
-                    tris[0][out_index].gl_Position[W], 
-                    tris[0][in0_index].gl_Position[W]);
-    float ac_nop_weight = ac_weight * tris[0][out_index].gl_Position[W]
-                * calc_noperspective_weight(ac_weight,
-                    tris[0][out_index].gl_Position[W],
-                    tris[0][in1_index].gl_Position[W]);
-
-
-    vec4 ab = ab_weight * a.gl_Position + (1 - ab_weight) * b.gl_Position;
-    vec4 ac = ac_weight * a.gl_Position + (1 - ac_weight) * c.gl_Position;
-
-
-    add_data_geos(tris, ac, b.gl_Position, c.gl_Position);
-    copy_data_geos_data(state, (const data_geometry **)(&(tris[0])),
-        &(tris[1]), out_index, in0_index, in1_index);
-
-    add_data_geos(tris, ab, b.gl_Position, ac);
-    copy_data_geos_data(state, (const data_geometry **)(&(tris[0])),
-        &(tris[2]), out_index, in0_index, in1_index);
-        
     for (int i = 0; i < state.floats_per_vertex; i++) {
         switch (state.interp_rules[i]) {
+        // Flat data is replaced by the data of the first vertex once the
+        // whole triangle is clipped
         case interp_type::flat:
-            for (unsigned j = 1; j < VERT_PER_TRI; j++) {
-                tris[1][j].data[i] = tris[0][out_index].data[i];
-                tris[2][j].data[i] = tris[0][out_index].data[i];
-            }
+            out.data[i] = a.data[i];
             break;
-    
+
+        // Data interpolated in clip space (before the divide by w) is
+        // already perspective correct
         case interp_type::smooth:
-            tris[1][V_A].data[i] = interpolate_data(ac_weight,
-                tris[0][out_index].data[i], tris[0][in1_index].data[i]);
-
-            tris[2][V_A].data[i] = interpolate_data(ab_weight,
-                tris[0][out_index].data[i], tris[0][in0_index].data[i]);
-            // Vertex a of triangle 1 and vertec c of triangle 2 are the 
-            // same point so they share the same interpolated data
-            tris[2][V_C].data[i] = tris[1][V_A].data[i];
+            out.data[i] = interpolate_data(a_weight, a.data[i], b.data[i]);
             break;
 
+        // Screen space interpolation has to account for w, which changes
+        // along the edge
         case interp_type::noperspective:
-            tris[1][V_A].data[i] = interpolate_data(ac_nop_weight,
-                tris[0][out_index].data[i], tris[0][in1_index].data[i]);
-            
-            tris[2][V_A].data[i] = interpolate_data(ab_nop_weight,
-                tris[0][out_index].data[i], tris[0][in0_index].data[i]);
-            // Vertex a of triangle 1 and vertec c of triangle 2 are the 
-            // same point so they share the same interpolated data
-            tris[2][V_C].data[i] = tris[1][V_A].data[i];
+            out.data[i] = interpolate_data(nop_weight, a.data[i], b.data[i]);
             break;
 
         default:
@@ -738,7 +2116,6 @@ void create_triangle_2_in(std::vector<data_geometry *>& tris,
             break;
         }
     }
-    remove_data_geo(0, tris);
 }
 
 float interpolate_data(float weight, float data0, float data1) {
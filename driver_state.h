@@ -3,6 +3,293 @@
 #include "common.h"
 #include <vector>
 
+class thread_pool;
+struct driver_state;
+
+// Width and height in pixels of the screen tiles used by the multithreaded
+// rasterizer.  Each tile is rasterized by a single worker.
+static const int TILE_SIZE = 64;
+
+// Number of pixels whose barycentric weights are computed from one exact
+// evaluation of the edge functions.  Pixels within such a run are reached by
+// adding precomputed offsets, and runs always start at a multiple of
+// RASTER_STEP so the weights of a pixel do not depend on where the traversal
+// began.
+static const int RASTER_STEP = 8;
+
+// Each run is shaded as a single span
+static_assert(RASTER_STEP <= MAX_SPAN, "a run must fit in a span");
+
+// Large triangles are traversed in square blocks of BLOCK_SIZE pixels, aligned
+// to multiples of BLOCK_SIZE.  By default a triangle uses the block traversal
+// when its bounding box (clipped to the area being drawn) is at least
+// BLOCK_MIN_EXTENT pixels wide and tall (see raster_thresholds).
+static const int BLOCK_SIZE = RASTER_STEP;
+static const int BLOCK_MIN_EXTENT = 2 * BLOCK_SIZE;
+
+// Largest bounding box, in pixels wide and tall, the small triangle path can
+// handle.  That path finds the covered pixels before any attribute is set up.
+static const int SMALL_TRIANGLE_EXTENT = 4;
+
+// Values that are constant over a triangle and are computed once before its
+// pixels are visited.
+struct triangle_setup
+{
+    // Pixel coordinates of the vertices
+    float x[VERT_PER_TRI];
+    float y[VERT_PER_TRI];
+
+    // Edge functions, scaled so that they evaluate directly to the screen
+    // space barycentric weights:
+    //   bary[i] = k0[i] + k1[i] * x + k2[i] * y
+    float k0[VERT_PER_TRI];
+    float k1[VERT_PER_TRI];
+    float k2[VERT_PER_TRI];
+
+    // k1[i] * j for j in [0, RASTER_STEP), the change in bary[i] between the
+    // start of a run and the j-th pixel of the run
+    float x_step[VERT_PER_TRI][RASTER_STEP];
+
+    // Perspective divided z coordinate of each vertex
+    float z[VERT_PER_TRI];
+
+    // Inclusive range of pixels to visit
+    int min_x, min_y;
+    int max_x, max_y;
+
+    // Lower bound on the depth the pixel loops can compute for any pixel
+    // inside the triangle, rounding included
+    float nearest_depth;
+
+    // Index of the triangle in the visibility buffer when shading is deferred
+    int id;
+
+    // Set when the vertices were snapped to the sub-pixel grid.  Pixel (x, y)
+    // is then inside the triangle exactly when
+    //   edge_a[i] * x + edge_b[i] * y + edge_c[i] > 0
+    // for every i.  These are the edge functions in integer grid units, with
+    // the top-left rule folded into edge_c, so a pixel on an edge shared by
+    // two triangles is inside exactly one of them.
+    bool snapped;
+    long long edge_a[VERT_PER_TRI];
+    long long edge_b[VERT_PER_TRI];
+    long long edge_c[VERT_PER_TRI];
+};
+
+// Coarse copy of image_depth used to reject hidden triangles before visiting
+// their pixels.  Level 0 stores the farthest depth of each BLOCK_SIZE block,
+// level 1 the farthest depth of each TILE_SIZE tile.  Writes to image_depth
+// only mark the entries covering them as dirty; a dirty entry is recomputed
+// from the level below the next time it is read.  An entry is therefore
+// never nearer than the depths it covers, so rejection is conservative.
+struct depth_pyramid
+{
+    int blocks_x = 0;
+    int blocks_y = 0;
+    std::vector<float> block_farthest;
+    std::vector<unsigned char> block_dirty;
+
+    int tiles_x = 0;
+    int tiles_y = 0;
+    std::vector<float> tile_farthest;
+    std::vector<unsigned char> tile_dirty;
+};
+
+// Number of fragments inside a triangle that reached the depth test, and how
+// many of them passed it.  Fragments skipped by the hierarchical Z test never
+// reach it, so the triangles it skipped whole within a tile and the blocks it
+// skipped inside big triangles are counted on their own.
+struct fragment_counts
+{
+    long long tested = 0;
+    long long passed = 0;
+    long long hidden_triangles = 0;
+    long long hidden_blocks = 0;
+};
+
+// Plane equations of the per-vertex data over a triangle, so that the value
+// at any pixel costs a couple of multiply-adds.  Planes are measured from the
+// pixel position (x0, y0) of the first vertex:
+//   value(x, y) = c + dx * (x - x0) + dy * (y - y0)
+// Smooth data is stored as data/w, next to a plane for 1/w, so perspective
+// correction only costs one reciprocal per pixel.  Flat data only uses c.
+struct attribute_planes
+{
+    float x0, y0;
+
+    float c[MAX_FLOATS_PER_VERTEX];
+    float dx[MAX_FLOATS_PER_VERTEX];
+    float dy[MAX_FLOATS_PER_VERTEX];
+
+    // Plane of 1/w
+    float w_c, w_dx, w_dy;
+
+    // Index of the triangle in the visibility buffer when shading is deferred
+    int id;
+
+    // Color of every fragment of the triangle when it is shaded once
+    pixel color;
+};
+
+// A run of consecutive data floats [first, end) sharing one interpolation
+// rule
+struct interp_run
+{
+    interp_type type;
+    int first, end;
+};
+
+// interp_rules compiled into runs once per draw, so the pixel loops do not
+// have to look at the rule of every float.  Flat data is the same over the
+// whole triangle, so it is kept apart from the runs that are interpolated at
+// every pixel.
+struct interp_plan
+{
+    int num_flat = 0;
+    interp_run flat[MAX_FLOATS_PER_VERTEX];
+
+    // Smooth and noperspective runs
+    int num_varying = 0;
+    interp_run varying[MAX_FLOATS_PER_VERTEX];
+
+    // Whether any run is smooth and so needs w
+    bool needs_w = false;
+};
+
+// Output of the vertex shader for every vertex of the current draw.  Each
+// vertex takes stride floats: its gl_Position followed by floats_per_vertex
+// floats of data, padded so that every vertex starts on a 16 byte boundary.
+// Triangles are assembled by indexing into this buffer, so a vertex shared
+// by several triangles is only shaded once, and vertex_data is never
+// written.
+struct vertex_buffer
+{
+    int stride = 0;
+    std::vector<float> data;
+
+    // Clipping outcode of each vertex (see calc_outcode)
+    std::vector<unsigned> outcodes;
+
+    const float * get_vertex(int index) const
+    {return &data[index * stride];}
+};
+
+// Number of clipping faces of the view volume
+static const int NUM_CLIP_FACES = 6;
+
+// Bit masks of clipping faces, as used by outcodes.  Faces 2 and 5 are the
+// near (z = -w) and far (z = w) planes.
+static const unsigned ALL_CLIP_FACES = (1u << NUM_CLIP_FACES) - 1;
+static const unsigned NEAR_FAR_FACES = (1u << 2) | (1u << 5);
+
+// Half the width of the guard band in normalized device coordinates.
+// Triangles whose vertices are all in front of the eye and within
+// [-GUARD_BAND_SIZE, GUARD_BAND_SIZE] in x and y are only clipped against the
+// near and far planes when guard band clipping is enabled.
+static const float GUARD_BAND_SIZE = 4.0f;
+
+// Clipping a triangle against one face adds at most one vertex, so after
+// all six faces a triangle has at most 3 + 6 vertices.
+static const int MAX_CLIP_VERTICES = VERT_PER_TRI + NUM_CLIP_FACES;
+
+// A vertex of the polygon being clipped.  The data is stored in place so
+// clipping never has to allocate.
+struct clip_vertex
+{
+    vec4 gl_Position;
+    float data[MAX_FLOATS_PER_VERTEX];
+};
+
+// Comparisons the depth test can use.  A fragment is drawn when its depth is
+// less than (or equal to) the depth already stored at its pixel.
+enum class depth_func {less, equal};
+
+// Pixel loops a triangle can be routed to, by the size and shape of its
+// bounding box
+enum class raster_path {small, scanline, blocks};
+static const int NUM_RASTER_PATHS = 3;
+
+// Limits used to route triangles to a raster_path.  A bounding box (clipped to
+// the area being drawn) at most small_extent pixels wide and tall takes the
+// small triangle path.  One at least block_extent pixels wide and tall, and no
+// more than max_block_aspect times longer than it is wide (or the other way
+// around), takes the block traversal.  Everything else is walked in runs.
+struct raster_thresholds
+{
+    int small_extent = SMALL_TRIANGLE_EXTENT;
+    int block_extent = BLOCK_MIN_EXTENT;
+    int max_block_aspect = 8;
+};
+
+// Faces of triangles that are discarded before clipping
+enum class cull_face {none, front, back};
+
+// Order in which the vertices of a front facing triangle appear on screen
+enum class winding {ccw, cw};
+
+// Instruction sets the pixel loops can be run with.  Each level also allows
+// the ones before it.
+enum class simd_level {scalar, sse4, avx2};
+
+// A loop that visits the pixels of a set up triangle inside the rectangle
+// [x0, x1] x [y0, y1], z-buffering and shading each covered pixel.
+typedef void (*raster_kernel)(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1);
+
+// Interpolates the fragment data of a triangle to pixel (x, y), runs the
+// fragment shader on it and returns the resulting color.  frag is scratch
+// space the function may use for the interpolated data.
+typedef pixel (*pixel_shader)(driver_state& state, data_fragment& frag,
+    const attribute_planes& planes, int x, int y);
+
+// Post-clip triangles sorted into screen tiles.  Triangles are stored in the
+// order they were submitted, and each tile lists the triangles overlapping it
+// in that same order, so every pixel sees the same sequence of depth tests as
+// it would when rasterizing serially.
+struct tile_bins
+{
+    // Number of tiles across and down the image
+    int tiles_x = 0;
+    int tiles_y = 0;
+
+    // Copies of the clipped triangles.  Each vertex is stored as its
+    // gl_Position followed by floats_per_vertex floats of data, three vertices
+    // per triangle.
+    std::vector<float> vertex_data;
+    std::vector<triangle_setup> setups;
+    int num_triangles = 0;
+
+    // For each tile, the indices of the triangles that overlap it
+    std::vector<std::vector<int> > tiles;
+};
+
+// Result of rasterizing a draw when shading is deferred.  The pixel loops
+// only record which triangle is visible at each pixel; once the whole draw
+// is rasterized the planes of the triangles that are still visible somewhere
+// are set up, and each recorded pixel is shaded exactly once from them.
+// Shading from the planes gives the same colors as shading during
+// rasterization would.
+struct visibility_buffer
+{
+    // Id of the triangle visible at each pixel, or -1 where the draw wrote
+    // nothing.  Laid out like image_color.  Once the planes are built the ids
+    // are replaced by indices into planes.
+    std::vector<int> ids;
+
+    // Setup of each triangle submitted by the draw, indexed by id
+    std::vector<triangle_setup> setups;
+
+    // gl_Position and data of the vertices of each submitted triangle, in
+    // the same layout as tile_bins::vertex_data
+    std::vector<float> vertex_data;
+
+    // Attribute planes of the visible triangles
+    std::vector<attribute_planes> planes;
+
+    // Whether the recorded pixels take their triangle's color
+    bool shade_once = false;
+};
+
 struct driver_state
 {
     // Custom data that is stored per vertex, such as positions or colors.
@@ -67,6 +354,22 @@ struct driver_state
     void (*vertex_shader)(const data_vertex& in, data_geometry& out,
         const float * uniform_data);
 
+    // Optional span version of fragment_shader.  When set, the pixel loops
+    // shade each run of covered pixels with one call to it.
+    shader_f_span fragment_shader_span = 0;
+
+    // Set when fragment_shader is pure: its output depends only on its
+    // inputs and the uniform data.
+    bool fragment_shader_pure = false;
+
+    // Set when fragment_shader ignores its inputs entirely, so every fragment
+    // of the draw gets the same color
+    bool fragment_shader_constant = false;
+
+    // Optional batched version of vertex_shader.  When set, vertices are
+    // shaded VERTEX_BATCH_SIZE at a time with it instead of one at a time.
+    shader_v_batch vertex_shader_batch = 0;
+
     // Pointer to a function, which performs the role of a fragment shader.  It
     // should be called for each pixel (fragment) within each triangle.  The
     // fragment shader should be given interpolated vertex data (interpolated
@@ -74,6 +377,122 @@ struct driver_state
     void (*fragment_shader)(const data_fragment& in, data_output& out,
         const float * uniform_data);
 
+    // Number of threads used to shade vertices and rasterize.  With a single
+    // thread triangles are rasterized as soon as they are clipped; otherwise
+    // vertices are shaded in parallel chunks, triangles are binned into tiles
+    // and the tiles are rasterized in parallel at the end of each render.
+    int num_threads = 1;
+
+    // Only clip against the near and far planes when a triangle fits in the
+    // guard band; its parts off the sides of the screen are discarded by the
+    // rasterizer instead.
+    bool guard_band = false;
+
+    // Triangles facing this way are discarded before they are clipped.
+    // Whether a triangle faces the front is decided by the winding of its
+    // vertices on screen.
+    cull_face cull_mode = cull_face::none;
+    winding front_face = winding::ccw;
+
+    // Defer fragment shading until the draw is rasterized, so each pixel is
+    // shaded at most once per draw no matter how many triangles cover it
+    bool deferred = false;
+
+    // Number of fractional bits of the fixed-point grid vertices are snapped
+    // to before rasterization.  Zero disables snapping, and coverage is then
+    // decided by the signs of the floating point weights.
+    int subpixel_bits = 0;
+
+    // Shade fragments in aligned 2x2 quads so the fragment shader gets
+    // screen space derivatives of its inputs
+    bool quad_shading = false;
+
+    // Run each draw twice: once writing only depth, then again shading only
+    // the fragments whose depth equals the stored depth.  Each pixel is then
+    // shaded once per draw, except where fragments have exactly equal
+    // depths.
+    bool depth_prepass = false;
+
+    // Comparison used by the depth test of the pass being rasterized
+    depth_func depth_test = depth_func::less;
+
+    // Set while the first pass of a depth prepass is rasterized.  The pixel
+    // loops then only store depth: no planes are set up and image_color is
+    // never touched.
+    bool depth_only = false;
+
+    // Number of vertices shaded by each job when the vertex shader is run on
+    // the worker pool
+    int vertex_chunk_size = 1024;
+
+    // Draw the triangles of each render in order of their nearest depth
+    // rather than in the order they were submitted, so the depth test
+    // rejects more fragments before they are shaded
+    bool sort_triangles = false;
+
+    // Order in which the triangles of the current render are drawn when
+    // sort_triangles is set
+    std::vector<int> triangle_order;
+
+    // Worker threads shared by the parallel stages.  Created on the first
+    // render that needs more than one thread.
+    thread_pool * pool = 0;
+
+    // Vertex shader output for the draw being rendered
+    vertex_buffer shaded_vertices;
+
+    // Triangles waiting to be rasterized by the tile workers
+    tile_bins bins;
+
+    // Farthest depths of blocks and tiles of image_depth
+    depth_pyramid hiz;
+
+    // Depth test results of every render, kept per tile so that the tile
+    // workers never update the same counts.  The depth-only passes of a
+    // depth prepass are counted apart from the passes that shade.
+    std::vector<fragment_counts> tile_fragments;
+    std::vector<fragment_counts> tile_prepass_fragments;
+
+    // Visible triangle of each pixel when shading is deferred
+    visibility_buffer vis;
+
+    // Widest instruction set the pixel loops are allowed to use.  The loop
+    // actually used is the widest one that is also supported by the CPU, and
+    // is chosen at the start of each render.
+    simd_level max_simd = simd_level::avx2;
+    raster_kernel kernel = 0;
+
+    // Limits used to route each triangle to a pixel loop
+    raster_thresholds thresholds;
+
+    // Number of triangles routed to each raster_path, counted over whole
+    // triangles rather than the pieces drawn in each tile.  Depth-only
+    // passes draw the same triangles again and are not counted.
+    long long raster_path_count[NUM_RASTER_PATHS] = {};
+
+    // interp_rules of the draw being rendered, as runs
+    interp_plan plan;
+
+    // Shade each triangle once and fill its pixels with the color, rather
+    // than running the pixel shader at every pixel.  Used when every float
+    // is flat and the fragment shader is pure, since every fragment of a
+    // triangle then gets the same color.
+    bool shade_once = false;
+
+    // Shade runs of pixels with fragment_shader_span instead of calling the
+    // pixel shader for each pixel.  Used when there is a span shader, but
+    // neither a specialized pixel shader nor shading once per triangle.
+    bool shade_spans = false;
+
+    // Color of every fragment of the draw when the fragment shader is
+    // constant.  Such draws are shaded once and need no attribute planes.
+    pixel constant_color = 0;
+
+    // Shading done for every covered pixel.  Chosen at the start of each
+    // render: a version specialized for the current shaders and interp_rules
+    // when one exists, otherwise get_pixel_color.
+    pixel_shader shade_pixel = 0;
+
     driver_state();
     ~driver_state();
 };
@@ -92,17 +511,61 @@ void initialize_render(driver_state& state, int width, int height);
 //   render_type::strip -    The vertices are to be interpreted as a triangle strip.
 void render(driver_state& state, render_type type);
 
-// This function clips a triangle (defined by the three vertices in the "in" array).
-// It will be called recursively, once for each clipping face (face=0, 1, ..., 5) to
-// clip against each of the clipping faces in turn.  When face=6, clip_triangle should
-// simply pass the call on to rasterize_triangle.
+// Assembles, clips and rasterizes the given number of triangles from the
+// shaded vertices, waiting for the tile workers when there are any
+void draw_triangles(driver_state& state, render_type type, int triangles);
+
+// Takes a triangle straight out of the vertex shader, along with the outcodes
+// of its vertices.  Triangles entirely outside one face are dropped,
+// triangles inside every face skip clipping, and the rest are clipped (only
+// against the near and far planes when guard_band is set and the triangle
+// fits in the guard band).
+void process_triangle(driver_state& state, const data_geometry* in[3],
+    const unsigned * outcodes);
+
+// Hands a triangle that needs no further clipping to the rasterizer, or to
+// the tile bins when rasterizing with multiple threads
+void submit_triangle(driver_state& state, const data_geometry* in[3]);
+
+// This function clips a triangle (defined by the three vertices in the "in" array)
+// against the clipping faces face, face+1, ..., 5 in turn, treating the triangle
+// as a polygon.  The clipped polygon is split into a fan of triangles which are
+// passed on to rasterize_triangle (or binned when rasterizing with multiple
+// threads).  All of the work is done in fixed-size buffers on the stack.
 void clip_triangle(driver_state& state, const data_geometry* in[3],int face=0);
 
+// Same as clip_triangle, but clips against the faces whose bits are set in
+// "faces"
+void clip_triangle_faces(driver_state& state, const data_geometry* in[3],
+    unsigned faces);
+
 // Rasterize the triangle defined by the three vertices in the "in" array.  This
 // function is responsible for rasterization, interpolation of data to
 // fragments, calling the fragment shader, and z-buffering.
 void rasterize_triangle(driver_state& state, const data_geometry* in[3]);
 
+// Returns the pixel loop for a triangle whose bounding box, clipped to the
+// area being drawn, is width x height pixels
+raster_path classify_raster_path(const driver_state& state, int width,
+    int height);
+
+// Adds the triangle to the count of the path its whole bounding box takes
+void count_raster_path(driver_state& state, const triangle_setup& setup);
+
+// Rasterize the triangle, touching only the pixels inside the rectangle
+// [x0, x1] x [y0, y1].  Pixels are computed exactly as rasterize_triangle would
+// compute them, so a triangle drawn in pieces matches one drawn whole.
+void rasterize_triangle_rect(driver_state& state, const data_geometry* in[3],
+    const triangle_setup& setup, int x0, int y0, int x1, int y1);
+
+// rasterize_triangle_rect for triangles given raster_path::small, those no
+// bigger than raster_thresholds::small_extent (at most SMALL_TRIANGLE_EXTENT)
+// in either direction.  All candidate pixels are tested and z-buffered in
+// one pass; triangles left with no pixel to draw return before their
+// attribute planes are set up.
+void rasterize_small_triangle(driver_state& state, const data_geometry* in[3],
+    const triangle_setup& setup, int x0, int y0, int x1, int y1);
+
 /**************************************************************************/
 /* Initialization */
 /**************************************************************************/
@@ -118,27 +581,121 @@ void init_image_depth(driver_state& state);
 /* Render Helpers */
 /**************************************************************************/
 
-// The following 4 functions fill data geometry array with pointers to
-// vertecies from driver_state's vertex_data array
-// The way they do this is specified by their render_type suffix
-void fill_data_geo_triangle(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index);
+// Returns the number of triangles the draw contains, or -1 if the type is
+// invalid
+int count_triangles(const driver_state& state, render_type type);
+
+// Stores the indices of the three vertices of the given triangle of the draw
+void get_triangle_vertices(const driver_state& state, render_type type,
+    int triangle, int * vert_index);
+
+// Runs the vertex shader exactly once on every vertex used by the draw,
+// filling shaded_vertices.  With more than one thread, the vertices are
+// shaded on the worker pool in chunks of vertex_chunk_size.  The batched
+// vertex shader is used when the state has one.
+void shade_vertices(driver_state& state, render_type type);
+
+// Runs the batched vertex shader on the count (at most VERTEX_BATCH_SIZE)
+// vertices starting at first, storing the same results as shade_vertex would
+// for each of them.
+void shade_vertex_batch(driver_state& state, int first, int count);
+
+// Runs the vertex shader on a single vertex, storing the result and its
+// outcode in shaded_vertices
+void shade_vertex(driver_state& state, int index);
 
-void fill_data_geos_indexed(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index);
+// Fills triangle_order with the triangles of the render sorted front to back
+// by the nearest depth of their vertices.  The depths are quantized and
+// radix sorted, and the sort is stable, so triangles with the same key keep
+// their submission order.
+void sort_triangles_by_depth(driver_state& state, render_type type,
+    int triangles);
 
-void fill_data_geos_fan(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index);
 
-void fill_data_geos_strip(const driver_state& state,
-    data_geometry * data_geos[3], int & vert_index, int iteration);
+/**************************************************************************/
+/* Tile Binning */
+/**************************************************************************/
+
+// Empties the bins and sizes the tile grid for the current image
+void reset_tile_bins(driver_state& state);
+
+// Copies the triangle into the bins and records it in every tile its
+// bounding box overlaps
+void bin_triangle(driver_state& state, const data_geometry* in[3]);
+
+// Rasterizes every binned triangle, one tile per job on the worker pool, then
+// empties the bins
+void flush_tile_bins(driver_state& state);
+
+
+/**************************************************************************/
+/* Visibility Buffer */
+/**************************************************************************/
+
+
+// Clears the visibility buffer and turns off the shading the pixel loops do
+// themselves until the buffer is resolved
+void reset_visibility(driver_state& state);
+
+// Sets setup.id to the next triangle id and stores the setup and vertices of
+// the triangle, so its planes can be built if it ends up visible
+void add_visible_triangle(driver_state& state, const data_geometry* in[3],
+    triangle_setup& setup);
+
+// Used by the pixel loops in place of shading while shading is deferred.
+// Records planes.id, the only field of planes set while recording, as the
+// triangle visible at the pixel.  image_color is left alone until the pixel
+// is resolved.
+inline void record_visibility(driver_state& state,
+    const attribute_planes& planes, unsigned pixel_index)
+{
+    state.vis.ids[pixel_index] = planes.id;
+}
+
+// Sets up the planes of every triangle recorded in the visibility buffer,
+// and points ids at them
+void build_visible_planes(driver_state& state);
+
+// Shades every pixel recorded in the visibility buffer, one row per job on
+// the worker pool when there is one
+void resolve_visibility(driver_state& state);
 
-void calc_data_geo_pos(driver_state& state, data_geometry * data_geos[3]);
 
 /**************************************************************************/
 /* Rasterize Triangle Helpers */
 /**************************************************************************/
 
+// Fills in the per-triangle constants used by the raster loops.  Returns
+// false if the triangle covers no pixels (including when it has no area).
+bool setup_triangle(driver_state& state, const data_geometry* in[3],
+    triangle_setup& setup);
+
+// Evaluates the edge function of the given vertex at pixel (x, y) in double
+// precision, without the rounding of the pixel loops
+double calc_edge_at(const triangle_setup& setup, int vert, int x, int y);
+
+// Evaluates the edge function of the given vertex at the start of the run
+// of pixels beginning at (x, y)
+float calc_run_start(const triangle_setup& setup, int vert, int x, int y);
+
+// Fills in the plane equations of the triangle's data according to
+// interp_rules
+void setup_attribute_planes(const driver_state& state,
+    const data_geometry* in[3], const triangle_setup& setup,
+    attribute_planes& planes);
+
+// Prepares planes for shading the triangle: the attribute planes, followed
+// by the triangle's color when shade_once is set.  Draws with a constant
+// fragment shader only need the color, so their planes are skipped.
+void setup_triangle_shading(const driver_state& state,
+    const data_geometry* in[3], const triangle_setup& setup, bool shade_once,
+    attribute_planes& planes);
+
+// Calculates the barycentric weights of every pixel in [x, x + count) on row
+// y, where x is a multiple of RASTER_STEP and count <= RASTER_STEP.
+void calc_bary_run(const triangle_setup& setup, int x, int y, int count,
+    float bary[][VERT_PER_TRI]);
+
 void calc_pixel_coords(driver_state& state, const data_geometry& data_geo,
     float & i, float & j);
 
@@ -152,76 +709,242 @@ void calc_max_coord(const driver_state& state, float * x, float * y,
 
 bool is_pixel_inside(float * bary_weights);
 
+// Returns whether pixel (x, y), whose weights are bary, is inside the
+// triangle.  Snapped triangles use their integer edge functions, others the
+// signs of the weights.
+bool is_sample_covered(const triangle_setup& setup, int x, int y,
+    float * bary);
+
+// Snaps the pixel coordinates of the vertices to the state's sub-pixel grid
+// and sets up the integer edge functions.  Returns false if the snapped
+// triangle has no area.
+bool snap_triangle(const driver_state& state, triangle_setup& setup);
+
 
 /**************************************************************************/
-/* Fragment Shader */
+/* Hierarchical Z */
 /**************************************************************************/
 
-// Fills data_fragment's data array with interpolated data then calls the
-// state's fragment shader on the interpolated data
-pixel get_pixel_color(driver_state& state, data_fragment& frag,
-    const data_geometry * data_geos[3], float * screen_bary); 
+// Sizes the pyramid for the image and marks every entry dirty
+void reset_depth_pyramid(driver_state& state);
+
+// Records that image_depth was written at pixel (x, y)
+void mark_depth_written(driver_state& state, int x, int y);
+
+// Adds the depth test results of a pixel loop to the counts of the tile
+// holding pixel (x, y).  A loop run by a tile worker never leaves its tile.
+void count_fragments(driver_state& state, int x, int y, int tested,
+    int passed);
 
-// Calculates the interpolated data at the specified float of the vertex
-float interpolate_fragment_at(unsigned index, 
-    const data_geometry * data_geos[3], float * bary);
+// Adds the triangles and blocks skipped by the hierarchical Z test to the
+// counts of the tile holding pixel (x, y)
+void count_hidden(driver_state& state, int x, int y, int triangles,
+    int blocks);
 
-// Calculates the world space barycentric coordinates from the screen space
-// barycentric coordinates 
-void convert_from_screen(float * screen_bary, float * world_bary,
-    const data_geometry * data_geos[3]);
+// Returns the depth test results and hidden counts of the shading passes, or
+// of the depth-only passes when prepass is set, summed over every tile
+fragment_counts get_fragment_counts(const driver_state& state, bool prepass);
+
+// Returns the farthest depth stored in the given block or tile, refreshing
+// the entry first if it is dirty
+float get_block_farthest(driver_state& state, int bx, int by);
+float get_tile_farthest(driver_state& state, int tx, int ty);
+
+// Returns true if no fragment of a triangle, none of which are nearer than
+// nearest, can pass the depth test where the stored depth is no farther than
+// farthest
+bool is_depth_hidden(const driver_state& state, float nearest,
+    float farthest);
+
+// Returns true if every pixel of the triangle inside [x0, x1] x [y0, y1]
+// would fail the depth test against the blocks covering that rectangle
+bool is_rect_hidden(driver_state& state, const triangle_setup& setup,
+    int x0, int y0, int x1, int y1);
 
 
 /**************************************************************************/
-/* Z-Buffer */
+/* Raster Kernels */
 /**************************************************************************/
-void calc_z_coords(const data_geometry * data_geos[3], float * z);
 
-float calc_depth_at(float * z, float * bary);
+// The portable pixel loop.  Every other kernel produces exactly the same
+// image as this one.
+void rasterize_rect_scalar(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1);
+
+// Pixel loop for rectangles known to lie entirely inside the triangle.  It
+// skips the inside test and only z-buffers and shades.
+void rasterize_rect_covered(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1);
+
+// Pixel loop that shades in 2x2 quads aligned to even coordinates.  The data
+// of all four pixels of a quad is interpolated whenever any of them is drawn,
+// so the fragment shader gets the differences across the quad as dFdx and
+// dFdy.  Pixels of the quad that are not drawn (helper pixels) are never
+// written.  Coverage, depth and color are otherwise the same as for the
+// other loops.
+void rasterize_rect_quads(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1);
+
+// Hierarchical traversal for large triangles.  Each block is tested against
+// the three edge functions: blocks entirely outside an edge are skipped,
+// blocks entirely inside all edges go to rasterize_rect_covered (or to the
+// quad loop when shading quads), and the remaining blocks are handed to
+// state.kernel.
+void rasterize_rect_blocks(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1);
+
+// Pixel loops that test a whole run of pixels at once with SSE4.1 (four
+// pixels per instruction) or AVX2 (eight pixels per instruction).  They are
+// only available on x86 and must only be called when the CPU supports them.
+void rasterize_rect_sse4(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1);
+void rasterize_rect_avx2(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1);
+
+// Returns the widest instruction set that is both supported by this CPU and
+// no wider than max_level
+simd_level detect_simd_level(simd_level max_level);
+
+// Returns the pixel loop for the given instruction set
+raster_kernel select_raster_kernel(simd_level level);
 
 
 /**************************************************************************/
-/* Clipping */
+/* Fragment Shader */
 /**************************************************************************/
-// Calls remove_data_geo on each index, then clears the vector.
-void clear_data_geos(std::vector<data_geometry *>& tris);
 
-// Deletes the allocated data array for each geometry, then deletes the
-// data_geometry array at the specified index
-void remove_data_geo(unsigned index, std::vector<data_geometry *>& tris);
+// Compiles the state's interp_rules into state.plan
+void build_interp_plan(driver_state& state);
+
+// Stores the flat data of a triangle into data.  Pixel loops call this once
+// before shading any pixel with get_pixel_color, which only fills in the
+// interpolated data.
+void set_flat_data(const driver_state& state, const attribute_planes& planes,
+    float * data);
 
-// Add a new data_geometry array to the vector using data from the data_geos
-// Data is copied.
-void add_data_geos(const driver_state& state,
-    std::vector<data_geometry *>& tris, const data_geometry * data_geos[3]);
+// Fills data_fragment's data array with the data interpolated to pixel
+// (x, y) then calls the state's fragment shader on it.  The flat data must
+// already have been stored by set_flat_data.
+pixel get_pixel_color(driver_state& state, data_fragment& frag,
+    const attribute_planes& planes, int x, int y);
+
+// Calls the state's fragment shader on frag and converts its output to a
+// pixel
+pixel run_fragment_shader(const driver_state& state, data_fragment& frag);
 
-// Add a new data_geometry array to the vector from 3 gl_Positions
-void add_data_geos(std::vector<data_geometry *>& tris, const vec4& a, 
-    const vec4& b, const vec4& c);
+// Stores the color every fragment of the triangle gets in planes.color.  Only
+// valid when all of the data is flat.
+void shade_triangle_once(const driver_state& state,
+    attribute_planes& planes);
 
-// Copy each float from one data_geometry's data to another
-void copy_data_geos_data(const driver_state& state,
-    const data_geometry& from, data_geometry& to);
+// Runs a constant fragment shader once to find the color of the whole draw
+pixel calc_constant_color(const driver_state& state);
+
+// Returns whether the pixel loops need the flat data of their triangle.
+// Triangles shaded once already have their color, while shading is deferred
+// only the triangle id is recorded, and depth-only passes shade nothing.
+inline bool needs_flat_data(const driver_state& state)
+{
+    return !state.shade_once && !state.deferred && !state.depth_only;
+}
 
-void copy_data_geos_data(const driver_state& state, 
-    const data_geometry * from[3], data_geometry * to[3], unsigned a,
-    unsigned b, unsigned c);
+// Fragment the pixel loops hand to the fragment shader, along with the array
+// its data points into
+struct fragment_scratch
+{
+    float data[MAX_FLOATS_PER_VERTEX];
+    data_fragment frag;
+};
 
-// Convenience function to check if all vertices are inside
-bool all_inside(bool * inside);
+// Points scratch.frag at scratch.data and stores the flat data of the
+// triangle when the pixel loops need it.  Called by every pixel loop before
+// its first pixel.
+inline void init_fragment_scratch(const driver_state& state,
+    const attribute_planes& planes, fragment_scratch& scratch)
+{
+    scratch.frag.data = scratch.data;
+    if (needs_flat_data(state)) {
+        set_flat_data(state, planes, scratch.data);
+    }
+}
+
+// Color of the fragment at (x, y): the triangle's color when triangles are
+// shaded once, otherwise the result of the state's pixel shader
+inline pixel shade_fragment(driver_state& state, data_fragment& frag,
+    const attribute_planes& planes, int x, int y)
+{
+    if (state.shade_once) {
+        return planes.color;
+    }
+    return state.shade_pixel(state, frag, planes, x, y);
+}
 
-// Convenience function to check if all vertices are outside
-bool all_outside(bool * inside);
+// Interpolates the data of the pixels of row y in [x, x + count) to run the
+// span fragment shader on them, then stores the color of each pixel whose
+// bit is set in mask.  count is at most MAX_SPAN.
+void shade_span(driver_state& state, const attribute_planes& planes, int x,
+    int y, int count, unsigned mask);
 
-// Create a new triangle with two vertices outside of the plane 
-void create_triangle_2_out(std::vector<data_geometry *>& tris,
-    unsigned axis, int sign, unsigned in_index, unsigned out0_index,
-    unsigned out1_index, const driver_state& state);
+// Interpolates the data of the four pixels of the 2x2 quad whose top left
+// pixel is (x, y) into data, with the same arithmetic as get_pixel_color, and
+// stores the differences across the quad in dFdx and dFdy.  Pixels are
+// ordered left to right, then top to bottom.
+void interpolate_quad(const driver_state& state,
+    const attribute_planes& planes, int x, int y,
+    float data[][MAX_FLOATS_PER_VERTEX], float * dFdx, float * dFdy);
 
-// Create two new triangle with two vertices inside of the plane
-void create_triangle_2_in(std::vector<data_geometry *>& tris,
-    unsigned axis, int sign, unsigned out_index, unsigned in0_index,
-    unsigned in1_index, const driver_state& state);
+// Returns the pixel shader specialized for the state's vertex shader,
+// fragment shader and interp_rules, or get_pixel_color if there is none
+pixel_shader select_pixel_shader(const driver_state& state);
+
+
+
+/**************************************************************************/
+/* Z-Buffer */
+/**************************************************************************/
+void calc_z_coords(const data_geometry * data_geos[3], float * z);
+
+float calc_depth_at(const float * z, const float * bary);
+
+// Returns whether a fragment at depth passes the depth test against the
+// stored depth
+inline bool passes_depth_test(depth_func func, float depth, float stored)
+{
+    return func == depth_func::equal ? depth == stored : depth < stored;
+}
+
+
+/**************************************************************************/
+/* Clipping */
+/**************************************************************************/
+// Returns the outcode of the position: bit f is set when the position is
+// outside of clipping face f
+unsigned calc_outcode(const vec4& position);
+
+// Returns true if the triangle faces the way state.cull_mode discards.  The
+// facing is taken from the clip space positions, so it is right even for
+// triangles that cross the plane of the eye.  Triangles seen edge on have no
+// facing and are culled whenever culling is on.
+bool is_face_culled(const driver_state& state, const data_geometry* in[3]);
+
+// Returns true if every vertex of the triangle is in front of the eye and
+// inside the guard band
+bool is_inside_guard_band(const data_geometry* in[3]);
+
+// Returns the signed distance of the position from the given clipping face.
+// The position is inside the face when the distance is not negative.
+float calc_plane_distance(const vec4& position, int face);
+
+// Clips the convex polygon "in" with "count" vertices against a single face,
+// writing the result to "out" and returning its vertex count.  out must have
+// room for count + 1 vertices.
+int clip_polygon(const driver_state& state, const clip_vertex * in,
+    int count, clip_vertex * out, int face);
+
+// Stores the point a fraction t of the way from a to b in out.  Data is
+// interpolated according to interp_rules.
+void interpolate_clip_vertex(const driver_state& state, const clip_vertex& a,
+    const clip_vertex& b, float t, clip_vertex& out);
 
 float interpolate_data(float weight, float data0, float data1);
 
@@ -4,9 +4,32 @@
  * This is simple testbed for your GLSL implementation.
  *
  * Usage: ./driver -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]
+ *                 [ -j <threads> ] [ -c <chunk> ] [ -x <isa> ] [ -g ] [ -d ]
+ *                 [ -p ] [ -q ] [ -f <bits> ] [ -t <small>,<block>,<aspect> ]
+ *                 [ -b <face> ] [ -w <winding> ] [ -z ] [ -r ]
  *     <input-file>      File with commands to run
  *     <solution-file>   File with solution to compare with
  *     <stats-file>      Dump statistics to this file rather than stdout
+ *     <threads>         Number of threads used to shade and rasterize (default 1)
+ *     <chunk>           Vertices per job when shading in parallel (default 1024)
+ *     <isa>             Widest instruction set the pixel loops may use:
+ *                       scalar, sse4 or avx2 (default avx2)
+ *     -g                Clip against the guard band instead of the screen edges
+ *     -d                Defer shading until each draw is rasterized
+ *     -p                Run a depth-only pass before shading each draw
+ *     -q                Shade in 2x2 quads, giving shaders dFdx and dFdy
+ *     <bits>            Sub-pixel bits of the grid vertices are snapped to
+ *                       (0 to 8, default 0 for no snapping)
+ *     <small>           Largest triangle, in pixels, drawn by the small
+ *                       triangle loop (0 to 4, default 4)
+ *     <block>           Smallest triangle drawn block by block (default 16)
+ *     <aspect>          Longest ratio of the sides of a triangle drawn block
+ *                       by block (default 8)
+ *     <face>            Faces to cull: none, front or back (default none)
+ *     <winding>         Winding of front faces on screen: ccw or cw
+ *                       (default ccw)
+ *     -z                Draw the triangles of each render front to back
+ *     -r                Write the rasterizer statistics to <stats-file>
  *
  * Only the -i is manditory.  You must specify a test to run.  For example:
  *
@@ -24,6 +47,71 @@
  *
  * The -o flag is used for the grading script, so that grading will not be
  * confused by debug print statements.
+ *
+ * The -j flag runs the pipeline on a pool of worker threads.  The vertex
+ * shader is run on chunks of vertices in parallel, and each thread rasterizes
+ * a different set of screen tiles.  The result is identical to the single
+ * threaded result, so it may be combined with -s:
+ *
+ * ./driver -i 23.txt -s 23.png -j 4
+ *
+ * The pixel loops use the widest SIMD instruction set the CPU supports.  The
+ * -x flag caps it, for example -x scalar forces the portable loop.  All of
+ * them produce the same image.
+ *
+ * The -g flag enables guard band clipping: triangles that cross the sides of
+ * the screen are no longer split by the clipper as long as they fit inside a
+ * band four times the size of the screen.  Only the near and far planes are
+ * clipped against and the rasterizer discards the pixels off screen.
+ *
+ * The -d flag defers shading: each draw is first rasterized into a visibility
+ * buffer recording the nearest triangle at every pixel, then every recorded
+ * pixel is shaded once.  Fragments that end up hidden are never shaded.  The
+ * image is the same as without -d.
+ *
+ * The -p flag is an alternative to -d: each draw is rasterized twice, first
+ * writing only depth, then shading just the fragments whose depth equals the
+ * stored depth.  Where triangles have exactly the same depth at a pixel, the
+ * last one drawn wins instead of the first, so the image may differ slightly.
+ * -d and -p cannot be combined.
+ *
+ * The -q flag shades fragments in 2x2 quads so that fragment shaders can read
+ * the screen space derivatives of their inputs.  It uses a scalar pixel loop
+ * and cannot be combined with -d.
+ *
+ * The -f flag snaps vertices to a fixed-point grid with the given number of
+ * sub-pixel bits (4 or 8 are typical) and decides coverage with exact integer
+ * edge functions and a top-left rule, so a pixel on an edge shared by two
+ * triangles is drawn exactly once.  The snapping moves edges slightly, so
+ * images may differ a little from the unsnapped result.
+ *
+ * Each triangle is drawn by the pixel loop that suits the size and shape of
+ * its bounding box: a small triangle loop, a loop over runs of pixels, or a
+ * traversal of 8x8 blocks.  The -t flag sets the limits between them and
+ * records the limits and the number of triangles each loop drew in the
+ * statistics.  The image is the same whatever the limits.  The -r flag
+ * records the same statistics without changing the limits.
+ *
+ * The -b flag discards triangles facing the given way before they are
+ * clipped, and -w sets which winding faces the front.  Culling only leaves
+ * the image unchanged when the discarded faces are hidden anyway, as the
+ * inside faces of a closed mesh are.
+ *
+ * The -z flag sorts the triangles of each render by their nearest depth and
+ * draws them front to back, so that more fragments fail the depth test before
+ * being shaded.  The rasterizer statistics lead with how many fragments
+ * passed the depth test, which are the ones shaded unless shading is
+ * deferred, and can be compared with and without -z.  The rejected rate only
+ * covers fragments that reached the depth test; the triangles and 8x8 blocks
+ * the hierarchical Z test skipped before it are counted on the next line.
+ * With -p the depth-only pass is reported on its own lines, and the
+ * triangles are only counted once:
+ *
+ * ./driver -i 23.txt -r
+ * ./driver -i 23.txt -r -z
+ *
+ * Where triangles have exactly the same depth at a pixel, the one drawn first
+ * wins, so like -p the image may differ slightly.
  */
 #include <cassert>
 #include <climits>
@@ -100,9 +188,32 @@ void compare(driver_state& state, FILE* stats_file, const char* solution_file)
 void Usage(const char* prog_name)
 {
     std::cerr<<"Usage: "<<prog_name<<" -i <input-file> [ -s <solution-file> ] [ -o <stats-file> ]"<<std::endl;
+    std::cerr<<"           [ -j <threads> ] [ -c <chunk> ] [ -x <isa> ] [ -g ] [ -d ]"<<std::endl;
+    std::cerr<<"           [ -p ] [ -q ] [ -f <bits> ] [ -t <small>,<block>,<aspect> ]"<<std::endl;
+    std::cerr<<"           [ -b <face> ] [ -w <winding> ] [ -z ] [ -r ]"<<std::endl;
     std::cerr<<"    <input-file>      File with commands to run"<<std::endl;
     std::cerr<<"    <solution-file>   File with solution to compare with"<<std::endl;
     std::cerr<<"    <stats-file>      Dump statistics to this file rather than stdout"<<std::endl;
+    std::cerr<<"    <threads>         Number of threads used to shade and rasterize (default 1)"<<std::endl;
+    std::cerr<<"    <chunk>           Vertices per job when shading in parallel (default 1024)"<<std::endl;
+    std::cerr<<"    <isa>             Widest instruction set the pixel loops may use:"<<std::endl;
+    std::cerr<<"                      scalar, sse4 or avx2 (default avx2)"<<std::endl;
+    std::cerr<<"    -g                Clip against the guard band instead of the screen edges"<<std::endl;
+    std::cerr<<"    -d                Defer shading until each draw is rasterized"<<std::endl;
+    std::cerr<<"    -p                Run a depth-only pass before shading each draw"<<std::endl;
+    std::cerr<<"    -q                Shade in 2x2 quads, giving shaders dFdx and dFdy"<<std::endl;
+    std::cerr<<"    <bits>            Sub-pixel bits of the grid vertices are snapped to"<<std::endl;
+    std::cerr<<"                      (0 to 8, default 0 for no snapping)"<<std::endl;
+    std::cerr<<"    <small>           Largest triangle, in pixels, drawn by the small"<<std::endl;
+    std::cerr<<"                      triangle loop (0 to 4, default 4)"<<std::endl;
+    std::cerr<<"    <block>           Smallest triangle drawn block by block (default 16)"<<std::endl;
+    std::cerr<<"    <aspect>          Longest ratio of the sides of a triangle drawn block"<<std::endl;
+    std::cerr<<"                      by block (default 8)"<<std::endl;
+    std::cerr<<"    <face>            Faces to cull: none, front or back (default none)"<<std::endl;
+    std::cerr<<"    <winding>         Winding of front faces on screen: ccw or cw"<<std::endl;
+    std::cerr<<"                      (default ccw)"<<std::endl;
+    std::cerr<<"    -z                Draw the triangles of each render front to back"<<std::endl;
+    std::cerr<<"    -r                Write the rasterizer statistics to <stats-file>"<<std::endl;
     exit(EXIT_FAILURE);
 }
 
@@ -111,19 +222,37 @@ int main(int argc, char** argv)
     const char* solution_file = 0;
     const char* input_file = 0;
     const char* statistics_file = 0;
+    const char* isa = 0;
+    const char* thresholds = 0;
+    const char* cull = 0;
+    const char* front = 0;
+    bool report = false;
     
     driver_state state;
 
     // Parse commandline options
     while(1)
     {
-        int opt = getopt(argc, argv, "s:i:o:");
+        int opt = getopt(argc, argv, "s:i:o:j:c:x:gdpqf:t:b:w:zr");
         if(opt==-1) break;
         switch(opt)
         {
             case 's': solution_file = optarg; break;
             case 'i': input_file = optarg; break;
             case 'o': statistics_file = optarg; break;
+            case 'j': state.num_threads = atoi(optarg); break;
+            case 'c': state.vertex_chunk_size = atoi(optarg); break;
+            case 'x': isa = optarg; break;
+            case 'g': state.guard_band = true; break;
+            case 'd': state.deferred = true; break;
+            case 'p': state.depth_prepass = true; break;
+            case 'q': state.quad_shading = true; break;
+            case 'f': state.subpixel_bits = atoi(optarg); break;
+            case 't': thresholds = optarg; break;
+            case 'b': cull = optarg; break;
+            case 'w': front = optarg; break;
+            case 'z': state.sort_triangles = true; break;
+            case 'r': report = true; break;
         }
     }
 
@@ -133,6 +262,74 @@ int main(int argc, char** argv)
         std::cerr<<"Test file required.  Use -i."<<std::endl;
         Usage(argv[0]);
     }
+    if(state.num_threads<1)
+    {
+        std::cerr<<"Thread count must be at least 1."<<std::endl;
+        Usage(argv[0]);
+    }
+    if(state.deferred && state.depth_prepass)
+    {
+        std::cerr<<"The -d and -p flags cannot be combined."<<std::endl;
+        Usage(argv[0]);
+    }
+    if(state.deferred && state.quad_shading)
+    {
+        std::cerr<<"The -d and -q flags cannot be combined."<<std::endl;
+        Usage(argv[0]);
+    }
+    if(state.subpixel_bits<0 || state.subpixel_bits>8)
+    {
+        std::cerr<<"Sub-pixel bits must be between 0 and 8."<<std::endl;
+        Usage(argv[0]);
+    }
+    if(state.vertex_chunk_size<1)
+    {
+        std::cerr<<"Chunk size must be at least 1."<<std::endl;
+        Usage(argv[0]);
+    }
+    if(thresholds)
+    {
+        raster_thresholds& t = state.thresholds;
+        if(sscanf(thresholds,"%d,%d,%d",&t.small_extent,&t.block_extent,&t.max_block_aspect)!=3
+            || t.small_extent<0 || t.small_extent>SMALL_TRIANGLE_EXTENT
+            || t.block_extent<1 || t.max_block_aspect<1)
+        {
+            std::cerr<<"Invalid thresholds '"<<thresholds<<"'."<<std::endl;
+            Usage(argv[0]);
+        }
+    }
+    if(cull)
+    {
+        if(!strcmp(cull,"none")) state.cull_mode=cull_face::none;
+        else if(!strcmp(cull,"front")) state.cull_mode=cull_face::front;
+        else if(!strcmp(cull,"back")) state.cull_mode=cull_face::back;
+        else
+        {
+            std::cerr<<"Unknown cull mode '"<<cull<<"'."<<std::endl;
+            Usage(argv[0]);
+        }
+    }
+    if(front)
+    {
+        if(!strcmp(front,"ccw")) state.front_face=winding::ccw;
+        else if(!strcmp(front,"cw")) state.front_face=winding::cw;
+        else
+        {
+            std::cerr<<"Unknown winding '"<<front<<"'."<<std::endl;
+            Usage(argv[0]);
+        }
+    }
+    if(isa)
+    {
+        if(!strcmp(isa,"scalar")) state.max_simd=simd_level::scalar;
+        else if(!strcmp(isa,"sse4")) state.max_simd=simd_level::sse4;
+        else if(!strcmp(isa,"avx2")) state.max_simd=simd_level::avx2;
+        else
+        {
+            std::cerr<<"Unknown instruction set '"<<isa<<"'."<<std::endl;
+            Usage(argv[0]);
+        }
+    }
 
     // Parse the input file, setup state, request renders
     parse(input_file, state);
@@ -144,6 +341,35 @@ int main(int argc, char** argv)
     if(solution_file)
         compare(state, stats_file, solution_file);
 
+    // Record how the triangles were split between the pixel loops, how many
+    // of their fragments passed the depth test and how much the hierarchical
+    // Z test skipped before it
+    if(thresholds || report)
+    {
+        const raster_thresholds& t = state.thresholds;
+        fprintf(stats_file, "thresholds: small %d block %d aspect %d\n",
+            t.small_extent, t.block_extent, t.max_block_aspect);
+        fprintf(stats_file, "triangles: small %lld scanline %lld blocks %lld\n",
+            state.raster_path_count[(int)raster_path::small],
+            state.raster_path_count[(int)raster_path::scanline],
+            state.raster_path_count[(int)raster_path::blocks]);
+        fragment_counts f = get_fragment_counts(state, false);
+        fprintf(stats_file, "fragments: passed %lld tested %lld rejected %.2f%%\n",
+            f.passed, f.tested,
+            f.tested ? 100.0*(f.tested-f.passed)/f.tested : 0.0);
+        fprintf(stats_file, "hidden: triangles %lld blocks %lld\n",
+            f.hidden_triangles, f.hidden_blocks);
+        if(state.depth_prepass)
+        {
+            f = get_fragment_counts(state, true);
+            fprintf(stats_file, "prepass fragments: passed %lld tested %lld rejected %.2f%%\n",
+                f.passed, f.tested,
+                f.tested ? 100.0*(f.tested-f.passed)/f.tested : 0.0);
+            fprintf(stats_file, "prepass hidden: triangles %lld blocks %lld\n",
+                f.hidden_triangles, f.hidden_blocks);
+        }
+    }
+
     // Save the computed solution to file
     dump_png(state.image_color,state.image_width,state.image_height,"output.png");
 
@@ -142,6 +142,11 @@ void parse(const char* test_file, driver_state& state)
             ss>>name;
             state.vertex_shader=vertex_shader_map[name];
             assert(state.vertex_shader);
+            // Use the batched version of the shader when there is one
+            if(vertex_shader_batch_map.count(name))
+                state.vertex_shader_batch=vertex_shader_batch_map[name];
+            else
+                state.vertex_shader_batch=0;
         }
         else if(item=="fragment_shader")
         {
@@ -150,6 +155,13 @@ void parse(const char* test_file, driver_state& state)
             ss>>name;
             state.fragment_shader=fragment_shader_map[name];
             assert(state.fragment_shader);
+            if(fragment_shader_span_map.count(name))
+                state.fragment_shader_span=fragment_shader_span_map[name];
+            else
+                state.fragment_shader_span=0;
+            state.fragment_shader_pure=pure_fragment_shaders.count(name)>0;
+            state.fragment_shader_constant=
+                constant_fragment_shaders.count(name)>0;
         }
         else
         {
@@ -0,0 +1,325 @@
+#include "driver_state.h"
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+simd_level detect_simd_level(simd_level max_level) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+
+    if (max_level >= simd_level::avx2 && __builtin_cpu_supports("avx2")) {
+        return simd_level::avx2;
+    }
+    if (max_level >= simd_level::sse4 && __builtin_cpu_supports("sse4.1")) {
+        return simd_level::sse4;
+    }
+#endif
+    return simd_level::scalar;
+}
+
+raster_kernel select_raster_kernel(simd_level level) {
+    switch (level) {
+    case simd_level::avx2:
+        return rasterize_rect_avx2;
+
+    case simd_level::sse4:
+        return rasterize_rect_sse4;
+
+    default:
+        return rasterize_rect_scalar;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Shades and stores each pixel of the run starting at (x, y) whose bit is set
+// in mask.  depth holds the depth of every pixel in the run.
+static void shade_run(driver_state& state, data_fragment& frag,
+    const attribute_planes& planes, int x, int y, unsigned mask,
+    const float * depth) {
+
+    unsigned pixel_index = x + y * state.image_width;
+
+    if (mask) {
+        mark_depth_written(state, x, y);
+    }
+
+    // Depth-only passes store nothing else, deferred ones the triangle id
+    if (state.depth_only || state.deferred) {
+        for (unsigned bits = mask; bits; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            state.image_depth[pixel_index + i] = depth[i];
+            if (state.deferred) {
+                record_visibility(state, planes, pixel_index + i);
+            }
+        }
+        return;
+    }
+
+    if (state.shade_spans) {
+        for (unsigned bits = mask; bits; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            state.image_depth[pixel_index + i] = depth[i];
+        }
+        if (mask) {
+            shade_span(state, planes, x, y, 32 - __builtin_clz(mask), mask);
+        }
+        return;
+    }
+
+    while (mask) {
+        int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        state.image_color[pixel_index + i] =
+            shade_fragment(state, frag, planes, x + i, y);
+        state.image_depth[pixel_index + i] = depth[i];
+    }
+}
+
+// The arithmetic below mirrors rasterize_rect_scalar operation for operation
+// (including the order of the additions in the depth calculation and treating
+// NaN weights as inside), so both loops make the same decision for every
+// pixel.
+
+__attribute__((target("sse4.1")))
+void rasterize_rect_sse4(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    static const int LANES = 4;
+
+    float depth[RASTER_STEP];
+    float stored[RASTER_STEP];
+    int tested = 0;
+    int passed = 0;
+
+    fragment_scratch scratch;
+    init_fragment_scratch(state, planes, scratch);
+
+    bool equal_test = state.depth_test == depth_func::equal;
+
+    int min_x = std::max(setup.min_x, x0);
+    int min_y = std::max(setup.min_y, y0);
+    int max_x = std::min(setup.max_x, x1);
+    int max_y = std::min(setup.max_y, y1);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+    const __m128i color = _mm_set1_epi32(state.shade_once ? planes.color : 0);
+    __m128 z[VERT_PER_TRI];
+    for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+        z[vert] = _mm_set1_ps(setup.z[vert]);
+    }
+
+    for (int y = min_y; y <= max_y; y++) {
+        for (int run = min_x - min_x % RASTER_STEP; run <= max_x;
+            run += RASTER_STEP) {
+
+            int first = std::max(min_x - run, 0);
+            int count = std::min(max_x - run + 1, RASTER_STEP);
+            unsigned pixel_index = run + y * state.image_width;
+            unsigned mask = 0;
+
+            __m128 start[VERT_PER_TRI];
+            for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                start[vert] = _mm_set1_ps(calc_run_start(setup, vert, run, y));
+            }
+
+            // Only read the depth of pixels inside the rectangle, the run may
+            // extend past the end of the image.
+            const float * run_depth = state.image_depth + pixel_index;
+            if (first != 0 || count != RASTER_STEP) {
+                for (int i = first; i < count; i++) {
+                    stored[i] = state.image_depth[pixel_index + i];
+                }
+                run_depth = stored;
+            }
+
+            // Runs fully inside the rectangle of a triangle that is shaded
+            // once are filled directly, by blending its color and depth
+            // into the stored ones.  Depth-only passes blend just the depth.
+            bool fill = (state.shade_once || state.depth_only) && first == 0
+                && count == RASTER_STEP;
+
+            for (int half = 0; half < RASTER_STEP; half += LANES) {
+                __m128 offset = _mm_add_ps(lane, _mm_set1_ps(half));
+                __m128 valid = _mm_and_ps(
+                    _mm_cmpge_ps(offset, _mm_set1_ps(first)),
+                    _mm_cmplt_ps(offset, _mm_set1_ps(count)));
+
+                __m128 b[VERT_PER_TRI];
+                __m128 inside = valid;
+                for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                    b[vert] = _mm_add_ps(start[vert],
+                        _mm_loadu_ps(setup.x_step[vert] + half));
+                    inside = _mm_and_ps(inside, _mm_cmpnlt_ps(b[vert], zero));
+                }
+                if (!_mm_movemask_ps(inside)) {
+                    continue;
+                }
+
+                __m128 d = zero;
+                for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                    d = _mm_add_ps(d, _mm_mul_ps(z[vert], b[vert]));
+                }
+
+                __m128 old_depth = _mm_and_ps(valid,
+                    _mm_loadu_ps(run_depth + half));
+                __m128 pass = _mm_and_ps(inside, equal_test ?
+                    _mm_cmpeq_ps(d, old_depth) : _mm_cmplt_ps(d, old_depth));
+                unsigned half_mask = _mm_movemask_ps(pass);
+                tested += __builtin_popcount(_mm_movemask_ps(inside));
+                passed += __builtin_popcount(half_mask);
+                if (!half_mask) {
+                    continue;
+                }
+
+                if (fill) {
+                    if (!state.depth_only) {
+                        __m128i * colors = (__m128i *)(state.image_color
+                            + pixel_index + half);
+                        _mm_storeu_si128(colors, _mm_blendv_epi8(
+                            _mm_loadu_si128(colors), color,
+                            _mm_castps_si128(pass)));
+                    }
+                    _mm_storeu_ps(state.image_depth + pixel_index + half,
+                        _mm_blendv_ps(old_depth, d, pass));
+                } else {
+                    _mm_storeu_ps(depth + half, d);
+                }
+                mask |= half_mask << half;
+            }
+
+            if (fill) {
+                if (mask) {
+                    mark_depth_written(state, run, y);
+                }
+            } else {
+                shade_run(state, scratch.frag, planes, run, y, mask, depth);
+            }
+        }
+    }
+
+    if (tested) {
+        count_fragments(state, min_x, min_y, tested, passed);
+    }
+}
+
+__attribute__((target("avx2")))
+void rasterize_rect_avx2(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    float depth[RASTER_STEP];
+    int tested = 0;
+    int passed = 0;
+
+    fragment_scratch scratch;
+    init_fragment_scratch(state, planes, scratch);
+
+    bool equal_test = state.depth_test == depth_func::equal;
+
+    int min_x = std::max(setup.min_x, x0);
+    int min_y = std::max(setup.min_y, y0);
+    int max_x = std::min(setup.max_x, x1);
+    int max_y = std::min(setup.max_y, y1);
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i color =
+        _mm256_set1_epi32(state.shade_once ? planes.color : 0);
+    __m256 step[VERT_PER_TRI];
+    __m256 z[VERT_PER_TRI];
+    for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+        step[vert] = _mm256_loadu_ps(setup.x_step[vert]);
+        z[vert] = _mm256_set1_ps(setup.z[vert]);
+    }
+
+    for (int y = min_y; y <= max_y; y++) {
+        for (int run = min_x - min_x % RASTER_STEP; run <= max_x;
+            run += RASTER_STEP) {
+
+            int first = std::max(min_x - run, 0);
+            int count = std::min(max_x - run + 1, RASTER_STEP);
+            unsigned pixel_index = run + y * state.image_width;
+
+            __m256 valid = _mm256_and_ps(
+                _mm256_cmp_ps(lane, _mm256_set1_ps(first), _CMP_GE_OQ),
+                _mm256_cmp_ps(lane, _mm256_set1_ps(count), _CMP_LT_OQ));
+
+            __m256 b[VERT_PER_TRI];
+            __m256 inside = valid;
+            for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                b[vert] = _mm256_add_ps(
+                    _mm256_set1_ps(calc_run_start(setup, vert, run, y)),
+                    step[vert]);
+                inside = _mm256_and_ps(inside,
+                    _mm256_cmp_ps(b[vert], zero, _CMP_NLT_UQ));
+            }
+            if (!_mm256_movemask_ps(inside)) {
+                continue;
+            }
+
+            __m256 d = zero;
+            for (int vert = 0; vert < VERT_PER_TRI; vert++) {
+                d = _mm256_add_ps(d, _mm256_mul_ps(z[vert], b[vert]));
+            }
+
+            // The masked load leaves lanes outside the rectangle untouched, so
+            // runs that extend past the end of the image are safe.
+            __m256 old_depth = _mm256_maskload_ps(
+                state.image_depth + pixel_index, _mm256_castps_si256(valid));
+            __m256 pass = _mm256_and_ps(inside, equal_test ?
+                _mm256_cmp_ps(d, old_depth, _CMP_EQ_OQ) :
+                _mm256_cmp_ps(d, old_depth, _CMP_LT_OQ));
+            unsigned mask = _mm256_movemask_ps(pass);
+            tested += __builtin_popcount(_mm256_movemask_ps(inside));
+            passed += __builtin_popcount(mask);
+            if (!mask) {
+                continue;
+            }
+
+            // A triangle that is shaded once has the same color at every
+            // pixel, so its passing pixels are stored with masked stores.
+            // Depth-only passes store just the depth.
+            if (state.shade_once || state.depth_only) {
+                __m256i lanes = _mm256_castps_si256(pass);
+                if (!state.depth_only) {
+                    _mm256_maskstore_epi32(
+                        (int *)state.image_color + pixel_index, lanes, color);
+                }
+                _mm256_maskstore_ps(state.image_depth + pixel_index, lanes, d);
+                mark_depth_written(state, run, y);
+                continue;
+            }
+
+            _mm256_storeu_ps(depth, d);
+
+            shade_run(state, scratch.frag, planes, run, y, mask, depth);
+        }
+    }
+
+    if (tested) {
+        count_fragments(state, min_x, min_y, tested, passed);
+    }
+}
+
+#else
+
+// Without x86 intrinsics every kernel is the scalar one.  detect_simd_level
+// never reports support for these, but they still have to exist.
+void rasterize_rect_sse4(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    rasterize_rect_scalar(state, setup, planes, x0, y0, x1, y1);
+}
+
+void rasterize_rect_avx2(driver_state& state, const triangle_setup& setup,
+    const attribute_planes& planes, int x0, int y0, int x1, int y1)
+{
+    rasterize_rect_scalar(state, setup, planes, x0, y0, x1, y1);
+}
+
+#endif
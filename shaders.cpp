@@ -3,6 +3,11 @@
 // Lookup maps to access a shader by name.
 std::map<std::string,shader_v> vertex_shader_map;
 std::map<std::string,shader_f> fragment_shader_map;
+std::set<std::string> pure_fragment_shaders;
+std::set<std::string> constant_fragment_shaders;
+std::map<std::string,shader_v_batch> vertex_shader_batch_map;
+std::map<std::string,shader_f_span> fragment_shader_span_map;
+std::vector<pipeline_specialization> pipeline_specializations;
 
 // Simplest useful vertex shader; just copies over the positions.
 void vertex_shader_trivial(const data_vertex& in, data_geometry& out,
@@ -32,6 +37,59 @@ void vertex_shader_transform(const data_vertex& in, data_geometry& out,
     out.gl_Position = xform * vec4(v.position,1);
 }
 
+// Multiplies xform by the positions in the first three rows of in (with w=1)
+// for every lane of the batch.  Each lane is summed in the same order as
+// mat4::operator*, so the results match the per-vertex shaders bit for bit.
+// The lane loops are simple enough for the compiler to vectorize.
+static void transform_positions(const mat4& xform, const data_vertex_batch& in,
+    data_geometry_batch& out)
+{
+    const float * px = in.data[0];
+    const float * py = in.data[1];
+    const float * pz = in.data[2];
+    for(int i=0;i<DATA_PER_COORD;i++)
+    {
+        float * o = out.gl_Position[i];
+        for(int lane=0;lane<VERTEX_BATCH_SIZE;lane++)
+        {
+            float v = 0;
+            v += xform(i,0) * px[lane];
+            v += xform(i,1) * py[lane];
+            v += xform(i,2) * pz[lane];
+            v += xform(i,3) * 1.0f;
+            o[lane] = v;
+        }
+    }
+}
+
+// Batched vertex_shader_trivial
+void vertex_shader_trivial_batch(const data_vertex_batch& in,
+    data_geometry_batch& out, const float * uniform_data)
+{
+    for(int i=0;i<3;i++)
+        for(int lane=0;lane<VERTEX_BATCH_SIZE;lane++)
+            out.gl_Position[i][lane] = in.data[i][lane];
+    for(int lane=0;lane<VERTEX_BATCH_SIZE;lane++)
+        out.gl_Position[W][lane] = 1;
+}
+
+// Batched vertex_shader_color
+void vertex_shader_color_batch(const data_vertex_batch& in,
+    data_geometry_batch& out, const float * uniform_data)
+{
+    transform_positions(*(const mat4*)uniform_data, in, out);
+    for(int i=3;i<6;i++)
+        for(int lane=0;lane<VERTEX_BATCH_SIZE;lane++)
+            out.data[i][lane] = in.data[i][lane];
+}
+
+// Batched vertex_shader_transform
+void vertex_shader_transform_batch(const data_vertex_batch& in,
+    data_geometry_batch& out, const float * uniform_data)
+{
+    transform_positions(*(const mat4*)uniform_data, in, out);
+}
+
 // Simple fragment shader: set the fragment to red
 void fragment_shader_red(const data_fragment& in, data_output& out,
     const float * uniform_data)
@@ -76,16 +134,113 @@ void fragment_shader_gouraud(const data_fragment& in, data_output& out,
     out.output_color = vec4(v.color,0);
 }
 
+// Span version of fragment_shader_uniform
+void fragment_shader_uniform_span(const data_fragment_span& in,
+    data_output_span& out, const float * uniform_data)
+{
+    transform_color& tc = *(transform_color*)uniform_data;
+    for(int i=0;i<3;i++)
+        for(int j=0;j<MAX_SPAN;j++)
+            out.output_color[i][j] = tc.color[i];
+    for(int j=0;j<MAX_SPAN;j++)
+        out.output_color[3][j] = 0;
+}
+
+// Span version of fragment_shader_gouraud
+void fragment_shader_gouraud_span(const data_fragment_span& in,
+    data_output_span& out, const float * uniform_data)
+{
+    for(int i=0;i<3;i++)
+        for(int j=0;j<MAX_SPAN;j++)
+            out.output_color[i][j] = in.data[3+i][j];
+    for(int j=0;j<MAX_SPAN;j++)
+        out.output_color[3][j] = 0;
+}
+
+// Interpolates the data for pixel (x, y) with the rules given by the template
+// arguments ('f', 's' or 'n' for each float) and shades it with
+// fragment_shader.  The arithmetic is the same as get_pixel_color's.  Since
+// the data lives in a local array, the compiler can drop any interpolation
+// the fragment shader does not read.
+template<shader_f fragment_shader, char... rules>
+static pixel shade_pixel_fixed(driver_state& state, data_fragment& frag,
+    const attribute_planes& planes, int x, int y)
+{
+    static const int num_floats = sizeof...(rules);
+    const char interp[num_floats] = {rules...};
+    float data[num_floats];
+    data_fragment in;
+    data_output out;
+    in.data = data;
+
+    float px = x - planes.x0;
+    float py = y - planes.y0;
+    float w = 1.0f / (planes.w_c + planes.w_dx * px + planes.w_dy * py);
+
+    for(int i=0;i<num_floats;i++)
+    {
+        if(interp[i]=='f')
+            data[i] = planes.c[i];
+        else if(interp[i]=='s')
+            data[i] = (planes.c[i] + planes.dx[i] * px + planes.dy[i] * py) * w;
+        else
+            data[i] = planes.c[i] + planes.dx[i] * px + planes.dy[i] * py;
+    }
+
+    fragment_shader(in, out, state.uniform_data);
+
+    return make_pixel(out.output_color[C_R] * C_MAX,
+        out.output_color[C_G] * C_MAX, out.output_color[C_B] * C_MAX);
+}
+
+static void add_specialization(shader_v vertex_shader,
+    shader_f fragment_shader, const std::string& interp_rules,
+    pixel_shader shade_pixel)
+{
+    pipeline_specialization spec;
+    spec.vertex_shader = vertex_shader;
+    spec.fragment_shader = fragment_shader;
+    spec.interp_rules = interp_rules;
+    spec.shade_pixel = shade_pixel;
+    pipeline_specializations.push_back(spec);
+}
+
 // Assign shaders to the maps so they can be accessed by name.
 void register_named_shaders()
 {
     vertex_shader_map["trivial"]=vertex_shader_trivial;
     vertex_shader_map["transform"]=vertex_shader_transform;
     vertex_shader_map["color"]=vertex_shader_color;
+    vertex_shader_batch_map["trivial"]=vertex_shader_trivial_batch;
+    vertex_shader_batch_map["transform"]=vertex_shader_transform_batch;
+    vertex_shader_batch_map["color"]=vertex_shader_color_batch;
     fragment_shader_map["red"]=fragment_shader_red;
     fragment_shader_map["green"]=fragment_shader_green;
     fragment_shader_map["blue"]=fragment_shader_blue;
     fragment_shader_map["white"]=fragment_shader_white;
     fragment_shader_map["gouraud"]=fragment_shader_gouraud;
     fragment_shader_map["uniform"]=fragment_shader_uniform;
+    fragment_shader_span_map["gouraud"]=fragment_shader_gouraud_span;
+    fragment_shader_span_map["uniform"]=fragment_shader_uniform_span;
+    pure_fragment_shaders.insert("red");
+    pure_fragment_shaders.insert("green");
+    pure_fragment_shaders.insert("blue");
+    pure_fragment_shaders.insert("white");
+    pure_fragment_shaders.insert("gouraud");
+    pure_fragment_shaders.insert("uniform");
+    constant_fragment_shaders.insert("red");
+    constant_fragment_shaders.insert("green");
+    constant_fragment_shaders.insert("blue");
+    constant_fragment_shaders.insert("white");
+    constant_fragment_shaders.insert("uniform");
+
+    // Pixel pipelines for the combinations the built-in shaders are used in.
+    // Pure shaders with only flat inputs and constant shaders are shaded
+    // once per triangle and never reach a pixel shader, so they have none.
+    add_specialization(vertex_shader_color, fragment_shader_gouraud, "fffnnn",
+        shade_pixel_fixed<fragment_shader_gouraud,
+            'f', 'f', 'f', 'n', 'n', 'n'>);
+    add_specialization(vertex_shader_color, fragment_shader_gouraud, "fffsss",
+        shade_pixel_fixed<fragment_shader_gouraud,
+            'f', 'f', 'f', 's', 's', 's'>);
 }
@@ -2,8 +2,12 @@
 #define __SHADERS__
 
 #include "common.h"
+#include "driver_state.h"
 #include "mat.h"
 #include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 // Vertex layout: each vertex stores only position, as a 3-vector
 struct vertex_p
@@ -31,6 +35,40 @@ struct transform_color : public uniform_transform
 
 extern std::map<std::string,shader_v> vertex_shader_map;
 extern std::map<std::string,shader_f> fragment_shader_map;
+
+// Names of the fragment shaders whose output depends only on their inputs and
+// the uniform data.  The driver may call these fewer times than there are
+// fragments.
+extern std::set<std::string> pure_fragment_shaders;
+
+// Names of the fragment shaders that ignore their inputs, so their output is
+// the same for every fragment of a draw.  The driver may skip interpolating
+// data for them.
+extern std::set<std::string> constant_fragment_shaders;
+
+// Batched versions of the vertex shaders in vertex_shader_map, under the same
+// names.  Not every vertex shader has one.
+extern std::map<std::string,shader_v_batch> vertex_shader_batch_map;
+
+// Span versions of the fragment shaders in fragment_shader_map, under the
+// same names.  Not every fragment shader has one.
+extern std::map<std::string,shader_f_span> fragment_shader_span_map;
+
+// A pixel shader compiled for one combination of vertex shader, fragment
+// shader and interpolation rules (spelled as in the vertex_data command, such
+// as "fffsss").  The interpolation and the fragment shader are inlined into
+// it, so it computes exactly what get_pixel_color would without the indirect
+// call or the switch on interp_rules for every float.
+struct pipeline_specialization
+{
+    shader_v vertex_shader;
+    shader_f fragment_shader;
+    std::string interp_rules;
+    pixel_shader shade_pixel;
+};
+
+extern std::vector<pipeline_specialization> pipeline_specializations;
+
 void register_named_shaders();
 
 #endif
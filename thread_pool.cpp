@@ -0,0 +1,93 @@
+#include "thread_pool.h"
+
+thread_pool::thread_pool(int num_threads)
+    : num_workers(num_threads < 1 ? 1 : num_threads)
+{
+    for (int i = 1; i < num_workers; i++) {
+        threads.push_back(std::thread(&thread_pool::worker_loop, this, i));
+    }
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+
+    for (unsigned i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+void thread_pool::run(int count, const std::function<void(int, int)>& work)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    // Nothing to share, so skip the synchronization entirely
+    if (num_workers == 1 || count == 1) {
+        for (int i = 0; i < count; i++) {
+            work(i, 0);
+        }
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        job = &work;
+        job_count = count;
+        next_index = 0;
+        active_workers = num_workers;
+        generation++;
+    }
+    work_ready.notify_all();
+
+    do_jobs(0);
+
+    // Wait for the other workers to finish the indices they claimed
+    std::unique_lock<std::mutex> guard(lock);
+    work_done.wait(guard, [this] { return active_workers == 0; });
+    job = 0;
+}
+
+void thread_pool::worker_loop(int worker)
+{
+    unsigned seen = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            work_ready.wait(guard, [this, seen] {
+                return stopping || generation != seen;
+            });
+
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+
+        do_jobs(worker);
+    }
+}
+
+void thread_pool::do_jobs(int worker)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (next_index < job_count) {
+        int index = next_index++;
+        const std::function<void(int, int)>& work = *job;
+
+        guard.unlock();
+        work(index, worker);
+        guard.lock();
+    }
+
+    if (--active_workers == 0) {
+        work_done.notify_one();
+    }
+}
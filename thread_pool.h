@@ -0,0 +1,50 @@
+#ifndef __THREAD_POOL__
+#define __THREAD_POOL__
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that are created once and reused for every
+// parallel stage of the pipeline.  The thread that calls run() takes part in
+// the work as worker 0, so a pool of size n only spawns n - 1 threads.
+class thread_pool
+{
+public:
+    explicit thread_pool(int num_threads);
+    ~thread_pool();
+
+    // Number of workers, including the calling thread
+    int size() const { return num_workers; }
+
+    // Calls job(index, worker) once for every index in [0, count).  Indices
+    // are handed out dynamically, so a worker that finishes early picks up the
+    // next unclaimed index.  worker is in [0, size()) and can be used to
+    // select per-thread scratch space.  Returns once every call has finished.
+    void run(int count, const std::function<void(int, int)>& job);
+
+private:
+    void worker_loop(int worker);
+    void do_jobs(int worker);
+
+    int num_workers;
+    std::vector<std::thread> threads;
+
+    std::mutex lock;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    // Description of the batch currently being run.  generation is bumped
+    // every time a new batch is posted so sleeping workers can tell it apart
+    // from the previous one.
+    const std::function<void(int, int)> * job = 0;
+    int job_count = 0;
+    int next_index = 0;
+    int active_workers = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+};
+
+#endif